@@ -0,0 +1,100 @@
+# Expands a sample document and compares the output and the diagnostics with
+# the expected ones. Run by the tests with GLSEXPAND, INPUT and WORK_DIR
+# defined, and optionally:
+#
+#   GLOSSARY           glossary passed to --glossary
+#   COMPILE            pass the glossary compiled with --compile-glossary
+#   OPTIONS            further options, separated by spaces
+#   RESULT             expected exit code, 0 by default
+#   MIN_SIZE           repeat the document until it has at least this size
+#   EXPECTED           file holding the expected output
+#   EXPECTED_ERRORS    file holding the expected diagnostics
+#   REFERENCE_OPTIONS  compare with the output and the diagnostics of the
+#                      same document expanded with these options instead
+#   ERRORS_ONLY        compare the diagnostics only, as the output of an
+#                      expansion that stops at the first error is incomplete
+#
+# The document is expanded in WORK_DIR under its own name so that the
+# diagnostics do not depend on the location of the build.
+
+get_filename_component (name ${INPUT} NAME)
+
+file (REMOVE_RECURSE ${WORK_DIR})
+file (MAKE_DIRECTORY ${WORK_DIR})
+file (READ ${INPUT} document)
+
+if (MIN_SIZE)
+  string (LENGTH "${document}" size)
+
+  while (size LESS MIN_SIZE)
+    string (APPEND document "${document}")
+    string (LENGTH "${document}" size)
+  endwhile (size LESS MIN_SIZE)
+endif (MIN_SIZE)
+
+file (WRITE ${WORK_DIR}/${name} "${document}")
+
+if (NOT RESULT)
+  set (RESULT 0)
+endif (NOT RESULT)
+
+set (arguments)
+
+if (GLOSSARY AND COMPILE)
+  execute_process (COMMAND ${GLSEXPAND} --glossary ${GLOSSARY}
+      --compile-glossary ${WORK_DIR}/glossary.bin
+    RESULT_VARIABLE result)
+
+  if (result)
+    message (FATAL_ERROR "glsexpand --compile-glossary exited with ${result}")
+  endif (result)
+
+  set (GLOSSARY ${WORK_DIR}/glossary.bin)
+endif (GLOSSARY AND COMPILE)
+
+if (GLOSSARY)
+  list (APPEND arguments --glossary ${GLOSSARY})
+endif (GLOSSARY)
+
+function (expand options output errors)
+  separate_arguments (options)
+
+  execute_process (COMMAND ${GLSEXPAND} ${options} ${arguments} ${name}
+    WORKING_DIRECTORY ${WORK_DIR}
+    RESULT_VARIABLE result
+    OUTPUT_FILE ${output}
+    ERROR_FILE ${errors})
+
+  if (NOT result EQUAL RESULT)
+    message (FATAL_ERROR "glsexpand ${options} exited with ${result} instead of ${RESULT}")
+  endif (NOT result EQUAL RESULT)
+endfunction (expand)
+
+function (compare actual expected)
+  execute_process (COMMAND ${CMAKE_COMMAND} -E compare_files ${actual} ${expected}
+    RESULT_VARIABLE different)
+
+  if (different)
+    message (FATAL_ERROR "${actual} differs from ${expected}")
+  endif (different)
+endfunction (compare)
+
+expand ("${OPTIONS}" ${WORK_DIR}/output.tex ${WORK_DIR}/errors.txt)
+
+if (DEFINED REFERENCE_OPTIONS)
+  expand ("${REFERENCE_OPTIONS}" ${WORK_DIR}/reference.tex ${WORK_DIR}/reference.txt)
+
+  if (NOT ERRORS_ONLY)
+    compare (${WORK_DIR}/output.tex ${WORK_DIR}/reference.tex)
+  endif (NOT ERRORS_ONLY)
+
+  compare (${WORK_DIR}/errors.txt ${WORK_DIR}/reference.txt)
+endif (DEFINED REFERENCE_OPTIONS)
+
+if (EXPECTED)
+  compare (${WORK_DIR}/output.tex ${EXPECTED})
+endif (EXPECTED)
+
+if (EXPECTED_ERRORS)
+  compare (${WORK_DIR}/errors.txt ${EXPECTED_ERRORS})
+endif (EXPECTED_ERRORS)
@@ -0,0 +1,36 @@
+# Records the profile of an instrumented glsexpand on the documents of the
+# benchmarks. Run by the pgo-train target with GLSEXPAND, GLSEXPAND_BENCH,
+# WORK_DIR, PROFILE_DIR and, for Clang, LLVM_PROFDATA defined.
+
+file (REMOVE_RECURSE ${WORK_DIR} ${PROFILE_DIR})
+file (MAKE_DIRECTORY ${WORK_DIR}/corpus ${WORK_DIR}/output ${PROFILE_DIR})
+
+function (run)
+  execute_process (COMMAND ${ARGN}
+    RESULT_VARIABLE result
+    OUTPUT_FILE ${WORK_DIR}/output.tex)
+
+  if (NOT result EQUAL 0)
+    message (FATAL_ERROR "Training failed: ${ARGN}")
+  endif (NOT result EQUAL 0)
+endfunction (run)
+
+run (${GLSEXPAND_BENCH} --write-corpus=${WORK_DIR}/corpus)
+
+file (GLOB documents ${WORK_DIR}/corpus/*.tex)
+
+# Cover the ways inputs are expanded: several inputs at once, each on its own
+# in a single pass, parsed and expanded in parallel, and streamed
+run (${GLSEXPAND} -o ${WORK_DIR}/output ${documents})
+run (${GLSEXPAND} -j 0 -o ${WORK_DIR}/output ${documents})
+
+foreach (document ${documents})
+  run (${GLSEXPAND} ${document})
+  run (${GLSEXPAND} -j 0 ${document})
+  run (${GLSEXPAND} --stream ${document})
+endforeach (document ${documents})
+
+if (LLVM_PROFDATA)
+  file (GLOB profiles ${PROFILE_DIR}/*.profraw)
+  run (${LLVM_PROFDATA} merge -output=${PROFILE_DIR}/glsexpand.profdata ${profiles})
+endif (LLVM_PROFDATA)
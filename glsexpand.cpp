@@ -23,410 +23,522 @@
 // SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //
 
-// #define BOOST_SPIRIT_X3_DEBUG
-
-#include <algorithm>
-#include <sstream>
-#include <iomanip>
-#include <iostream>
-#include <iterator>
-#include <locale>
-#include <map>
-#include <string>
-#include <vector>
-
-#include <boost/filesystem/fstream.hpp>
-#include <boost/spirit/home/support/iterators/istream_iterator.hpp>
-#include <boost/spirit/home/x3.hpp>
-#include <boost/spirit/home/x3/support/ast/variant.hpp>
-
-namespace ast {
-
-enum Flags
+
+#include "glsexpand_core.hpp"
+
+#include <boost/program_options.hpp>
+
+// Allocations made so far, reported by --stats. The global allocation
+// functions are replaced to count them, but not in the library whose users
+// may provide their own. Allocations are only counted once --stats enabled
+// counting, which costs a relaxed load per allocation otherwise.
+std::atomic<std::size_t> allocations{0};
+std::atomic<bool> countAllocations{false};
+
+void* operator new(std::size_t size)
 {
-    None      = 0,
-    Plural    = 1 << 0,
-    Uppercase = 1 << 1,
-    First     = 1 << 2
-};
+    if (countAllocations.load(std::memory_order_relaxed))
+        allocations.fetch_add(1, std::memory_order_relaxed);
 
-constexpr int ModifiersMask = Plural | Uppercase;
+    if (void* p = std::malloc(size != 0 ? size : 1))
+        return p;
 
-// Abbreviation definition
-struct Abbreviation
+    throw std::bad_alloc{};
+}
+
+// Not inlined so that the compiler does not mistake freeing what the
+// replaced operator new returned as a mismatch
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif // defined(__GNUC__)
+void operator delete(void* p) noexcept
 {
-    std::string name;
-    std::string shortName;
-    std::string value;
-};
+    std::free(p);
+}
 
-// Reference to an abbreviation
-struct Reference
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif // defined(__GNUC__)
+void operator delete(void* p, std::size_t) noexcept
 {
-    std::string name;
-    unsigned flags;
-};
+    std::free(p);
+}
 
-} // namespace ast
+int main(int argc, char** argv)
+{
+    namespace po = boost::program_options;
+
+    std::vector<std::string> glossaries;
+    std::vector<std::string> inputs;
+    std::string outputDirectory;
+    std::string cacheDirectory;
+    std::string compiledGlossary;
+    bool sharedFirstUse = false;
+    bool watch = false;
+    bool stream = false;
+    bool keepGoing = false;
+    bool stats = false;
+    unsigned jobs = 1;
+
+    po::options_description visible{"Options"};
+    visible.add_options()
+        ("help,h", "show this help message")
+        ("glossary,g", po::value(&glossaries)->value_name("FILE"),
+            "read additional \\newacronym definitions from FILE")
+        ("output-dir,o", po::value(&outputDirectory)->value_name("DIR"),
+            "write each expanded input to DIR instead of the standard output")
+        ("shared-first-use", po::bool_switch(&sharedFirstUse),
+            "carry the first use of abbreviations over from one input to the "
+            "next as if the inputs were concatenated")
+        ("jobs,j", po::value(&jobs)->value_name("N")->default_value(jobs),
+            "process up to N inputs in parallel, 0 uses all hardware threads")
+        ("cache-dir", po::value(&cacheDirectory)->value_name("DIR"),
+            "keep the definitions and the output of each input in DIR and reuse "
+            "them for inputs that did not change")
+        ("watch", po::bool_switch(&watch),
+            "keep running and expand the inputs again whenever any of them or "
+            "the glossaries change; requires --output-dir")
+        ("compile-glossary", po::value(&compiledGlossary)->value_name("FILE"),
+            "write the definitions of all glossaries and inputs to FILE in a "
+            "binary form that is used in place, without parsing and rendering "
+            "the definitions, when FILE is passed as the first --glossary, "
+            "instead of expanding the inputs")
+        ("stream", po::bool_switch(&stream),
+            "write the output of a single input while it is still being read; "
+            "requires each abbreviation to be defined before its first use")
+        ("keep-going,k", po::bool_switch(&keepGoing),
+            "continue after errors such as a malformed group or a reference "
+            "without definition, and report each with its line and column; "
+            "erroneous parts are copied as they are and the run still fails")
+        ("stats", po::bool_switch(&stats),
+            "write the time spent and the bytes processed in each stage along "
+            "with other counters as JSON to the standard error; in watch mode, "
+            "after each round for that round")
+        ;
 
-namespace gls {
-    using namespace boost::spirit::x3;
+    po::options_description hidden;
+    hidden.add_options()
+        ("input", po::value(&inputs))
+        ;
 
-    const rule<struct options, std::string> options = "options";
-    const rule<struct addition, std::string> addition = "addition";
+    po::options_description options;
+    options.add(visible).add(hidden);
 
-    const rule<struct text, std::string> text = "text";
-    const rule<struct nested, std::string> nested = "nested";
-    const rule<struct group, std::string> group = "group";
-    const rule<struct nested_group, std::string> nested_group = "nested_group";
+    po::positional_options_description positional;
+    positional.add("input", -1);
 
-    const auto text_def = lexeme[+(char_ - '{' - '}')];
-    const auto nested_def =
-        +(text | nested_group); // Allow to mix groups and text as in "{group1 {group2} text}"
-    // Make sure to capture the braces of nested groups
-    const auto nested_group_def = char_('{') >> nested >> char_('}');
-    const auto group_def = '{' >> -nested >> '}';
+    po::variables_map vm;
 
-    const auto options_def = '[' >> *(char_ - ']') >> ']';
+    try {
+        po::store(po::command_line_parser(argc, argv).options(options).positional(positional).run(), vm);
+        po::notify(vm);
+    }
+    catch (const po::error& e) {
+        std::cerr << "error: " << e.what() << '\n';
+        return EXIT_FAILURE;
+    }
 
-    BOOST_SPIRIT_DEFINE(text, nested, nested_group, group);
+    if (vm.count("help") || (inputs.empty() && (compiledGlossary.empty() || glossaries.empty()))) {
+        std::cerr << "usage: " << argv[0] << " [options] <input.tex | ->...\n\n" << visible;
+        return vm.count("help") ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    const auto addition_def =
-           "\\addition"
-        >> omit[options]
-        >> group
-        ;
+    if (watch && (outputDirectory.empty() ||
+                  std::find(inputs.begin(), inputs.end(), "-") != inputs.end())) {
+        std::cerr << "error: --watch requires --output-dir and cannot read the standard input\n";
+        return EXIT_FAILURE;
+    }
 
-    BOOST_SPIRIT_DEFINE(addition, options);
+    if (stream && (inputs.size() != 1 || !outputDirectory.empty() || !cacheDirectory.empty() ||
+                   watch || !compiledGlossary.empty() || keepGoing)) {
+        std::cerr << "error: --stream requires a single input written to the standard output "
+            "and cannot be combined with --cache-dir, --watch, --compile-glossary or --keep-going\n";
+        return EXIT_FAILURE;
+    }
 
-    const auto newacronym_def =
-           "\\newacronym"
-        >> group
-        [
-            (
-                [] (auto& ctx)
-                {
-                    _val(ctx).name = _attr(ctx);
-                }
-            )
-        ]
-        >> group
-        [
-            (
-                [] (auto& ctx)
-                {
-                    _val(ctx).shortName = _attr(ctx);
-                }
-            )
-        ]
-        >> group
-        [
-            (
-                [] (auto& ctx)
-                {
-                    _val(ctx).value = _attr(ctx);
-                }
-            )
-        ]
-        ;
+    if (!outputDirectory.empty()) {
+        // Each input is written to a file of the same name in the directory
+        std::map<std::filesystem::path, std::string> outputs;
 
-    // Parse \gls
-    const auto gls_def =
-           lit("\\gls")
-        >> group
-        [
-            (
-                [] (auto& ctx)
-                {
-                    _val(ctx).name = _attr(ctx);
-                    _val(ctx).flags = ast::None;
-                }
-            )
-        ]
-        ;
+        for (const std::string& input : inputs) {
+            const auto [pos, inserted] = outputs.emplace(std::filesystem::path{input}.filename(), input);
 
-    // Parse \Gls
-    const auto Gls_def =
-           lit("\\Gls")
-        >> group
-        [
-            (
-                [] (auto& ctx)
-                {
-                    _val(ctx).name = _attr(ctx);
-                    _val(ctx).flags = ast::Uppercase;
-                }
-            )
-        ]
-        ;
+            if (!inserted) {
+                std::cerr << "error: " << std::quoted(pos->second) << " and " << std::quoted(input)
+                    << " would both be written to " << std::filesystem::path{outputDirectory} / pos->first << '\n';
+                return EXIT_FAILURE;
+            }
+        }
+    }
 
-    // Parse \glspl
-    const auto glspl_def =
-           lit("\\glspl")
-        >> group
-        [
-            (
-                [] (auto& ctx)
-                {
-                    _val(ctx).name = _attr(ctx);
-                    _val(ctx).flags = ast::Plural;
+    if (jobs == 0)
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+
+    countAllocations.store(stats, std::memory_order_relaxed);
+
+    std::optional<Cache> cache;
+
+    try {
+        if (!cacheDirectory.empty())
+            cache.emplace(cacheDirectory);
+    }
+    catch (const std::filesystem::filesystem_error& e) {
+        std::cerr << "error: failed to create the cache directory " << e.path1() << '\n';
+        return EXIT_FAILURE;
+    }
+
+    // Definitions may follow their first use and are shared by all inputs:
+    // collect them in a pre-scan that keeps nothing but the definitions, then
+    // expand each input in a second streaming pass.
+    std::vector<std::string> fileNames{glossaries};
+    fileNames.insert(fileNames.end(), inputs.begin(), inputs.end());
+
+    using Clock = std::chrono::steady_clock;
+
+    std::vector<Stage> stages{{"load"}, {"dictionary"}, {"expand"}};
+    auto start = Clock::now();
+
+    // Ends the stage and starts the next one
+    const auto lap =
+        [&] (Stage& stage, std::uint64_t bytes)
+        {
+            const auto now = Clock::now();
+
+            stage.seconds = std::chrono::duration<double>(now - start).count();
+            stage.bytes = bytes;
+            start = now;
+        };
+
+    std::vector<Source> sources(fileNames.size());
+    std::vector<char> loaded(fileNames.size());
+
+    // Split the threads between the inputs; a single large input is parsed by
+    // all of them
+    const auto loadThreads = static_cast<unsigned>(std::max<std::size_t>(1, jobs / fileNames.size()));
+
+    // A single input is expanded while its definitions are collected if
+    // they precede their use; neither the cache nor the watch mode apply to
+    // the result. Large inputs are rather parsed and expanded in parallel.
+    std::error_code ec;
+    const bool singlePass = inputs.size() == 1 && !cache && !watch && compiledGlossary.empty() && !stream && (jobs == 1 ||
+        (inputs.front() != "-" && std::filesystem::file_size(inputs.front(), ec) < 2 * MinChunkSize && !ec));
+    const std::size_t loading = fileNames.size() - (singlePass || stream);
+
+    parallel_for(loading, jobs,
+        [&] (std::size_t i)
+        {
+            loaded[i] = load(fileNames[i], loadThreads, cache ? &*cache : nullptr, watch, keepGoing,
+                i < glossaries.size(), sources[i]);
+        }
+    );
+
+    if (std::find(loaded.begin(), loaded.begin() + loading, false) != loaded.begin() + loading)
+        return EXIT_FAILURE;
+
+    BuildDictionary dict;
+    Environment environment{dict.dict};
+    environment.cache = cache ? &*cache : nullptr;
+    environment.recover = keepGoing;
+
+    const auto build =
+        [&]
+        {
+            GLSEXPAND_TRACE_SCOPE(dictionary);
+
+            // Later definitions replace earlier ones in the order of the
+            // inputs. The single pass has built the dictionary that way
+            // already, rendering the definitions it used.
+            Source::Expansion* expansion = sources.back().expansion ? &*sources.back().expansion : nullptr;
+
+            if (expansion && expansion->definitions) {
+                dict.dict = std::move(*expansion->definitions);
+                expansion->definitions.reset();
+
+                for (const Source& source : sources)
+                    for (const ast::Abbreviation& definition : source.definitions)
+                        BuildDictionary::check(definition);
+            }
+            else {
+                dict.dict = Dictionary{};
+                std::size_t first = 0;
+
+                // A compiled glossary coming first is used as it is
+                if (!sources.empty() && sources.front().tables) {
+                    dict.dict.adopt(sources.front().definitions, *sources.front().tables);
+
+                    for (const ast::Abbreviation& definition : sources.front().definitions)
+                        BuildDictionary::check(definition);
+
+                    first = 1;
                 }
-            )
-        ]
-        ;
 
-    // Parse \Glspl
-    const auto Glspl_def =
-           lit("\\Glspl")
-        >> group
-        [
-            (
-                [] (auto& ctx)
-                {
-                    _val(ctx).name = _attr(ctx);
-                    _val(ctx).flags = ast::Uppercase | ast::Plural;
+                for (std::size_t i = first; i < sources.size(); ++i)
+                    for (const ast::Abbreviation& definition : sources[i].definitions)
+                        dict(definition);
+            }
+
+            dict.dict.finalize();
+
+            environment.fingerprint = 0;
+
+            // Only the records of the cache and of the watch mode depend on it
+            if (cache || watch)
+                for (std::size_t i = 0; i != dict.dict.size(); ++i) {
+                    const ast::Abbreviation& definition = dict.dict[i];
+                    // Separate the fields so that their boundaries matter
+                    for (std::string_view field : {definition.name, definition.shortName, definition.value})
+                        environment.fingerprint = hash_bytes(field, hash_bytes({"\0", 1}, environment.fingerprint));
                 }
-            )
-        ]
-        ;
+        };
+
+    if (singlePass) {
+        Source& document = sources.back();
+        Dictionary preceding;
+        std::size_t first = 0;
+
+        if (loading != 0 && sources.front().tables) {
+            preceding.adopt(sources.front().definitions, *sources.front().tables);
+            first = 1;
+        }
+
+        for (std::size_t i = first; i < loading; ++i)
+            for (const ast::Abbreviation& definition : sources[i].definitions)
+                preceding.insert(definition);
+
+        if (!open(fileNames.back(), false, document))
+            return EXIT_FAILURE;
+
+        // Otherwise, parse the opened input once more
+        if (!load_expanded(document, std::move(preceding)) &&
+            !load(fileNames.back(), jobs, nullptr, false, keepGoing, false, document))
+            return EXIT_FAILURE;
+    }
+
+    const auto lap_load =
+        [&]
+        {
+            std::uint64_t bytes = 0;
+
+            for (const Source& source : sources)
+                if (source.input)
+                    bytes += static_cast<std::uint64_t>(source.input->end() - source.input->begin());
+
+            lap(stages[0], bytes);
+        };
+
+    const auto print_statistics =
+        [&]
+        {
+            std::size_t definitions = 0;
 
-    // Parse \Glsfirst
-    const auto Glsfirst_def =
-           lit("\\Glsfirst")
-        >> group
-        [
-            (
-                [] (auto& ctx)
+            for (const Source& source : sources)
+                definitions += source.definitions.size();
+
+            std::ostringstream out;
+            write_statistics(out, stages, inputs.size(), definitions, dict.dict,
+                allocations.load(std::memory_order_relaxed));
+            report(out.str());
+        };
+
+    // Whether any input, including the glossaries, was loaded with errors
+    const auto recovered =
+        [&]
+        {
+            return std::any_of(sources.begin(), sources.end(),
+                [] (const Source& source)
                 {
-                    _val(ctx).name = _attr(ctx);
-                    _val(ctx).flags = ast::Uppercase | ast::First;
+                    return source.errors != 0;
                 }
-            )
-        ]
-        ;
+            );
+        };
 
-    const auto gls_other =
-           lit("\\gls") >> +alpha
-           ;
-
-    const rule<struct Gls, ast::Reference> Gls = "Gls";
-    const rule<struct Glsfrst, ast::Reference> Glsfirst = "Glsfirst";
-    const rule<struct Glspl, ast::Reference> Glspl = "Glspl";
-    const rule<struct gls, ast::Reference> gls = "gls";
-    const rule<struct glspl, ast::Reference> glspl = "glspl";
-    const rule<struct newacronym, ast::Abbreviation> newacronym = "newacronym";
-
-    BOOST_SPIRIT_DEFINE(newacronym);
-    BOOST_SPIRIT_DEFINE(gls);
-    BOOST_SPIRIT_DEFINE(glspl);
-    BOOST_SPIRIT_DEFINE(Gls);
-    BOOST_SPIRIT_DEFINE(Glsfirst);
-    BOOST_SPIRIT_DEFINE(Glspl);
-
-    const auto gls_commands =
-          newacronym
-        | gls
-        | glspl
-        | Gls
-        | Glsfirst
-        | Glspl
-        ;
+    lap_load();
+    build();
+    lap(stages[1], dict.dict.rendered());
 
-    const auto gls_tokens =
-    *(
-          gls_commands
-        | omit[gls_other]
-        |
-        +(
-            char_
-            - "\\newacronym"
-            - "\\gls"
-            - "\\glspl"
-            - "\\Gls"
-            - "\\Glspl"
-        )
-    ) >> eoi;
-
-    const auto addition_tokens =
-    *(
-          addition
-        |
-        +(
-            char_
-            - "\\addition"
-        )
-    ) >> eoi;
-
-} // namespace gls
-
-
-std::ostream& make_uppercase(std::ostream& out, const std::string& value)
-{
-    if (!value.empty())
-        out << std::toupper(value[0], std::locale::classic()) << value.substr(1);
+    if (!compiledGlossary.empty())
+        return write_compiled_glossary(compiledGlossary, dict.dict) && !recovered() ? EXIT_SUCCESS : EXIT_FAILURE;
 
-    return out;
-}
+    if (stream) {
+        // The dictionary only holds the glossaries; the input adds to a copy
+        const bool succeeded = expand_stream(inputs.front(), dict.dict, stdout);
 
-struct Expand
-{
-    using result_type = void;
+        lap(stages[2], statistics.get().outputBytes);
 
-    Expand(std::ostream& out, std::map<std::string, std::pair<ast::Abbreviation, bool> >& definitions)
-        : out(out)
-        , definitions(definitions)
-    {
-    }
+        if (stats)
+            print_statistics();
 
-    void operator()(const std::string& value) const
-    {
-        out << value;
+        return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    void operator()(const ast::Reference& value)
-    {
-        auto pos = definitions.find(value.name);
-
-        if (pos != definitions.end()) {
-            bool used = pos->second.second && (value.flags & ast::First) != ast::First;
-
-            switch (value.flags & ast::ModifiersMask) {
-                case ast::None:
-                    if (!used)
-                        out << pos->second.first.value << " (" << pos->second.first.shortName << ")";
-                    else
-                        out << pos->second.first.shortName;
-                    break;
-                case ast::Plural:
-                    if (!used)
-                        out << pos->second.first.value << "s" << " (" << pos->second.first.shortName << "s)";
-                    else
-                        out << pos->second.first.shortName << "s";
-                    break;
-                case ast::Uppercase:
-                    if (!used)
-                        make_uppercase(out, pos->second.first.value) << " (" << pos->second.first.shortName << ")";
-                    else
-                        make_uppercase(out, pos->second.first.shortName);
-                    break;
-                case ast::Uppercase | ast::Plural:
-                    if (!used)
-                        make_uppercase(out, pos->second.first.value) << "s" << " (" << pos->second.first.shortName << "s)";
-                    else
-                        make_uppercase(out, pos->second.first.shortName) << "s";
-                    break;
+    Source* documents = sources.data() + glossaries.size();
+
+    // Expands the i-th input to its output file in the output directory
+    const auto expand_input =
+        [&] (std::size_t i, std::vector<bool>& seen, unsigned threads)
+        {
+            const std::filesystem::path input{inputs[i]};
+            const std::filesystem::path output = outputDirectory / input.filename();
+            std::error_code ec;
+
+            if (inputs[i] == "-" || std::filesystem::equivalent(input, output, ec)) {
+                report("error: cannot write the output of ", std::quoted(inputs[i]), " to ", output);
+                return false;
             }
 
-            pos->second.second = true;
-        }
-        else
-            throw std::runtime_error("missing definition for " + value.name);
-    }
+            std::FILE* file = std::fopen(output.string().c_str(), "wb");
 
-    void operator()(const ast::Abbreviation& value) const
-    {
-    }
+            if (file == nullptr) {
+                report("error: failed to open output ", output);
+                return false;
+            }
 
-    std::ostream& out;
-    std::map<std::string, std::pair<ast::Abbreviation, bool> >& definitions;
-};
+            bool succeeded = expand_file(inputs[i], documents[i], environment, seen, threads, file);
 
-struct BuildDictionary
-{
-    using result_type = void;
+            if (std::fclose(file) != 0) {
+                report("error: failed to write the output ", output);
+                succeeded = false;
+            }
 
-    void operator()(const std::string& value) const
-    {
-    }
+            return succeeded;
+        };
 
-    void operator()(const ast::Reference& value) const
-    {
-        //std::cout << value.name << std::endl;
-    }
+    std::vector<char> expanded(inputs.size());
+    const auto threads = static_cast<unsigned>(std::max<std::size_t>(1, jobs / inputs.size()));
 
-    void operator()(const ast::Abbreviation& value)
-    {
-        //std::cout << value.name << std::endl;
-        dict[value.name] = std::make_pair(value, false);
+    if (sharedFirstUse || inputs.size() == 1 || jobs == 1) {
+        // The inputs depend on each other or there is nothing to parallelize
+        // across inputs; large inputs can still be expanded in parallel
+        std::vector<bool> seen;
 
-        if (value.value.empty())
-            std::cerr << "warning: description of " << value.name << " is empty\n";
+        for (std::size_t i = 0; i != inputs.size(); ++i) {
+            if (!sharedFirstUse)
+                seen.clear();
+
+            if (outputDirectory.empty())
+                expanded[i] = expand_file(inputs[i], documents[i], environment, seen, jobs, stdout);
+            else
+                expanded[i] = expand_input(i, seen, jobs);
+        }
     }
+    else if (outputDirectory.empty()) {
+        // Keep the order of the inputs on the standard output by expanding
+        // them into memory first
+        std::vector<StringSink> outputs(inputs.size());
+
+        parallel_for(inputs.size(), jobs,
+            [&] (std::size_t i)
+            {
+                std::vector<bool> seen;
+                expanded[i] = expand(inputs[i], documents[i], environment, seen, threads, outputs[i]);
+            }
+        );
 
-    std::map<std::string, std::pair<ast::Abbreviation, bool> > dict;
-};
+#ifdef HAVE_WRITEV
+        GatherWriter out{STDOUT_FILENO};
+#else
+        OutputBuffer out{stdout};
+#endif // HAVE_WRITEV
 
-int main(int argc, char** argv)
-{
-    boost::filesystem::ifstream in(argv[1]);
+        for (const StringSink& output : outputs)
+            out.write(output.text);
 
-    if (!in) {
-        std::cerr << "error: failed to open input " << std::quoted(argv[1]) << std::endl;
-        return EXIT_FAILURE;
+        if (!out.flush()) {
+            report("error: failed to write the output");
+            return EXIT_FAILURE;
+        }
+    }
+    else {
+        parallel_for(inputs.size(), jobs,
+            [&] (std::size_t i)
+            {
+                std::vector<bool> seen;
+                expanded[i] = expand_input(i, seen, threads);
+            }
+        );
     }
 
-    in.unsetf(std::ios_base::skipws);
-
-    using namespace boost::spirit::x3;
+    lap(stages[2], statistics.get().outputBytes);
 
-    using Entry = variant
-    <
-          std::string
-        , ast::Reference
-        , ast::Abbreviation
-    >;
+    if (stats)
+        print_statistics();
 
-    std::vector
-    <
-        Entry
-    > values;
+    if (!watch)
+        return std::find(expanded.begin(), expanded.end(), false) == expanded.end() && !recovered()
+            ? EXIT_SUCCESS : EXIT_FAILURE;
 
-    bool parsed = parse
-    (
-          boost::spirit::istream_iterator(in)
-        , boost::spirit::istream_iterator()
-        , gls::gls_tokens
-        , values
-    );
+    // Keep the inputs and the dictionary resident, and only redo the parts
+    // affected by a change: changed inputs are loaded again, and an input is
+    // expanded again only if its context has changed as well
+    std::unique_ptr<Watcher> watcher;
 
-    if (!parsed) {
-        std::cerr << "error: failed to parse the input\n";
+    try {
+        watcher = std::make_unique<Watcher>(fileNames);
+    }
+    catch (const std::exception& e) {
+        report("error: ", e.what());
         return EXIT_FAILURE;
     }
 
-    BuildDictionary dict;
+    for (;;) {
+        const auto changed = watcher->wait();
 
-    std::for_each(values.begin(), values.end(),
-        [&dict] (const auto& entry)
-        {
-            entry.apply_visitor(dict);
+        // The statistics of each round cover that round only
+        statistics.reset();
+        allocations.store(0, std::memory_order_relaxed);
+        start = Clock::now();
+
+        for (std::size_t i : changed) {
+            Source reloaded;
+
+            // Keep the previous state of inputs that cannot be used for now
+            if (!load(fileNames[i], loadThreads, cache ? &*cache : nullptr, true, keepGoing,
+                    i < glossaries.size(), reloaded))
+                continue;
+
+            if (sources[i].record && sources[i].record->content == reloaded.record->content)
+                continue;
+
+            sources[i] = std::move(reloaded);
         }
-    );
 
-    // Expansion of \addition requires a second pass
-    std::stringstream out;
+        lap_load();
+        build();
+        lap(stages[1], dict.dict.rendered());
 
-    Expand e{out, dict.dict};
+        std::vector<bool> seen;
+        std::vector<std::size_t> outdated;
 
-    for (auto val : values) {
-        val.apply_visitor(e);
-    }
+        for (std::size_t i = 0; i != inputs.size(); ++i) {
+            const CacheRecord& record = *documents[i].record;
 
-    std::string gls = out.str();
-    std::string expanded;
+            if (!sharedFirstUse)
+                seen.clear();
 
-    parsed = parse
-    (
-          gls.begin()
-        , gls.end()
-        , gls::addition_tokens
-        , expanded
-    );
+            if (record.expanded && record.context == hash_seen(seen, environment.fingerprint)) {
+                seen = record.seen;
+                continue;
+            }
 
-    if (!parsed) {
-        std::cerr << "error: failed to parse the input\n";
-        return EXIT_FAILURE;
-    }
+            if (!sharedFirstUse) {
+                outdated.push_back(i);
+                continue;
+            }
+
+            expand_input(i, seen, jobs);
+        }
 
-    std::copy(expanded.begin(), expanded.end(), std::ostreambuf_iterator<char>(std::cout));
+        parallel_for(outdated.size(), jobs,
+            [&] (std::size_t i)
+            {
+                std::vector<bool> seen;
+                expand_input(outdated[i], seen, threads);
+            }
+        );
+
+        lap(stages[2], statistics.get().outputBytes);
+
+        if (stats)
+            print_statistics();
+    }
 }
@@ -0,0 +1,81 @@
+//
+// Copyright (c) 2019 Sergiu Deitsch <sergiu.deitsch@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation and/or
+// other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+// ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef GLSEXPAND_HPP
+#define GLSEXPAND_HPP
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// In-memory interface of libglsexpand. Documents are expanded the same way
+// the glsexpand tool expands a single input: the first use of each
+// abbreviation starts over with every document.
+namespace glsexpand {
+
+// Abbreviation definitions shared by the expansion of several documents, such
+// as the chapters of a book using a common glossary
+class Glossary
+{
+public:
+    Glossary();
+    Glossary(Glossary&& other) noexcept;
+    ~Glossary();
+
+    Glossary& operator=(Glossary&& other) noexcept;
+
+    // Adds the \newacronym definitions of the document, which is copied.
+    // Later definitions replace earlier ones of the same abbreviation. Throws
+    // std::runtime_error if the document cannot be parsed.
+    void add(std::string_view document);
+
+    // Returns the number of abbreviations defined
+    std::size_t size() const noexcept;
+
+private:
+    struct Impl;
+
+    friend void expand(std::string_view, const Glossary*, const std::function<void(std::string_view)>&);
+    friend std::string expand(std::string_view, const Glossary*);
+
+    std::unique_ptr<Impl> impl_;
+};
+
+// Expands the document and passes the result to sink in pieces as it is
+// produced. Definitions in the document replace those of the glossary, if
+// any. Throws std::runtime_error if the document cannot be parsed or refers
+// to an abbreviation without definition; the pieces passed so far are then
+// incomplete.
+void expand(std::string_view document, const Glossary* glossary,
+    const std::function<void(std::string_view)>& sink);
+
+// Same as above, but returns the expanded document as a whole
+std::string expand(std::string_view document, const Glossary* glossary = nullptr);
+
+} // namespace glsexpand
+
+#endif // GLSEXPAND_HPP
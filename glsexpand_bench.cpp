@@ -0,0 +1,323 @@
+//
+// Copyright (c) 2019 Sergiu Deitsch <sergiu.deitsch@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation and/or
+// other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+// ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+// The benchmarks exercise the stages of glsexpand on the internals directly
+#include "glsexpand_core.hpp"
+
+#include <fstream>
+#include <random>
+
+#include <benchmark/benchmark.h>
+
+// Shape of a synthetic document
+struct Corpus
+{
+    std::size_t size;
+    // References per KiB of text
+    unsigned density;
+    // Number of abbreviations defined
+    std::size_t glossary;
+    // Nesting depth of the braces in descriptions and \addition
+    unsigned depth;
+    // \addition commands per KiB of text
+    unsigned additions;
+};
+
+// Appends text nested in depth levels of braces
+void nest(std::string& out, std::string_view text, unsigned depth)
+{
+    for (unsigned i = 0; i != depth; ++i)
+        out.append("{lvl").append(std::to_string(i)).append(" ");
+
+    out.append(text);
+    out.append(depth, '}');
+}
+
+// Generates a document defining the glossary up front followed by prose with
+// references and \addition interspersed. The same shape always yields the
+// same document.
+std::string generate(const Corpus& corpus)
+{
+    static const char* const words[] = {
+        "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+        "elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+        "et", "dolore", "magna", "aliqua"
+    };
+    static const char* const commands[] = {
+        "\\gls", "\\glspl", "\\Gls", "\\Glspl", "\\Glsfirst"
+    };
+
+    std::mt19937 random{42};
+    std::string out;
+
+    out.reserve(corpus.size + 128 * corpus.glossary);
+
+    for (std::size_t i = 0; i != corpus.glossary; ++i) {
+        const std::string name = "abbr" + std::to_string(i);
+
+        out.append("\\newacronym{").append(name).append("}{A").append(std::to_string(i)).append("}{");
+        nest(out, "description of " + name, corpus.depth);
+        out.append("}\n");
+    }
+
+    const std::size_t prologue = out.size();
+
+    // Expected number of bytes between two commands of each kind
+    const double referenceGap = corpus.density ? 1024.0 / corpus.density : 0;
+    const double additionGap = corpus.additions ? 1024.0 / corpus.additions : 0;
+
+    std::uniform_real_distribution<double> uniform;
+    std::uniform_int_distribution<std::size_t> word{0, std::size(words) - 1};
+    std::uniform_int_distribution<std::size_t> command{0, std::size(commands) - 1};
+    std::uniform_int_distribution<std::size_t> abbreviation{0, std::max<std::size_t>(1, corpus.glossary) - 1};
+
+    while (out.size() - prologue < corpus.size) {
+        const std::size_t before = out.size();
+
+        out.append(words[word(random)]).append(" ");
+
+        const double p = static_cast<double>(out.size() - before);
+
+        if (corpus.glossary != 0 && referenceGap != 0 && uniform(random) < p / referenceGap)
+            out.append(commands[command(random)]).append("{abbr")
+                .append(std::to_string(abbreviation(random))).append("} ");
+
+        if (additionGap != 0 && uniform(random) < p / additionGap) {
+            out.append("\\addition[note]{");
+            nest(out, words[word(random)], corpus.depth);
+            out.append("} ");
+        }
+    }
+
+    return out;
+}
+
+// Shape of the corpus from the benchmark arguments
+Corpus corpus(const std::vector<std::int64_t>& args)
+{
+    return Corpus{
+        static_cast<std::size_t>(args[0]) * 1024,
+        static_cast<unsigned>(args[1]),
+        static_cast<std::size_t>(args[2]),
+        static_cast<unsigned>(args[3]),
+        static_cast<unsigned>(args[4])
+    };
+}
+
+Corpus corpus(const benchmark::State& state)
+{
+    return corpus({state.range(0), state.range(1), state.range(2), state.range(3), state.range(4)});
+}
+
+// Parses the document into entries
+std::vector<ast::Entry> parse(const std::string& document)
+{
+    std::vector<ast::Entry> entries;
+
+    if (!parse_entries(document.data(), document.data() + document.size(), 1, entries))
+        throw std::runtime_error("failed to parse the corpus");
+
+    return entries;
+}
+
+Dictionary build(const std::vector<ast::Entry>& entries)
+{
+    BuildDictionary dict;
+
+    for (const ast::Entry& entry : entries)
+        entry.apply_visitor(dict);
+
+    dict.dict.finalize();
+
+    return std::move(dict.dict);
+}
+
+std::string expand(const std::vector<ast::Entry>& entries, const Dictionary& definitions)
+{
+    StringSink out;
+    std::vector<bool> seen;
+    Expand e{out, definitions, seen};
+
+    for (const ast::Entry& entry : entries)
+        entry.apply_visitor(e);
+
+    return std::move(out.text);
+}
+
+void BM_Parse(benchmark::State& state)
+{
+    const std::string document = generate(corpus(state));
+
+    for (auto _ : state) {
+        std::vector<ast::Entry> entries;
+        const char* pos = document.data();
+
+        parse_entries(pos, document.data() + document.size(), document.data() + document.size(), entries);
+        benchmark::DoNotOptimize(entries.data());
+    }
+
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * document.size()));
+}
+
+void BM_Expand(benchmark::State& state)
+{
+    const std::string document = generate(corpus(state));
+    const std::vector<ast::Entry> entries = parse(document);
+    const Dictionary definitions = build(entries);
+
+    for (auto _ : state) {
+        std::string output = expand(entries, definitions);
+        benchmark::DoNotOptimize(output.data());
+    }
+
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * document.size()));
+}
+
+void BM_Addition(benchmark::State& state)
+{
+    const std::string document = generate(corpus(state));
+    const std::vector<ast::Entry> entries = parse(document);
+    const std::string expanded = expand(entries, build(entries));
+
+    for (auto _ : state) {
+        StringSink out;
+        AdditionFilter filter{out};
+
+        filter.write(expanded);
+
+        if (!filter.finish())
+            state.SkipWithError("failed to resolve \\addition");
+
+        benchmark::DoNotOptimize(out.text.data());
+    }
+
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * expanded.size()));
+}
+
+// Both passes over the document as glossaries are expanded without keeping
+// the entries
+void BM_Streaming(benchmark::State& state)
+{
+    const std::string document = generate(corpus(state));
+    const char* first = document.data();
+    const char* last = first + document.size();
+
+    for (auto _ : state) {
+        BuildDictionary dict;
+
+        for_each_entry(first, last, nullptr, dict);
+        dict.dict.finalize();
+
+        StringSink out;
+        AdditionFilter filter{out};
+        std::vector<bool> seen;
+        Expand e{filter, dict.dict, seen};
+
+        for_each_entry(first, last, &dict.dict, e);
+        filter.finish();
+
+        benchmark::DoNotOptimize(out.text.data());
+    }
+
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * document.size()));
+}
+
+// Varies one property of the corpus at a time around a typical document
+std::vector<std::vector<std::int64_t> > shapes()
+{
+    const std::vector<std::int64_t> typical{1024, 8, 100, 1, 1};
+
+    const std::vector<std::vector<std::int64_t> > variations{
+        {64, 16384},
+        {0, 64},
+        {10, 10000},
+        {0, 8},
+        {0, 16}
+    };
+
+    std::vector<std::vector<std::int64_t> > result{typical};
+
+    for (std::size_t i = 0; i != variations.size(); ++i)
+        for (std::int64_t value : variations[i]) {
+            std::vector<std::int64_t> args = typical;
+            args[i] = value;
+            result.push_back(args);
+        }
+
+    return result;
+}
+
+void corpora(benchmark::internal::Benchmark* b)
+{
+    b->ArgNames({"KiB", "density", "glossary", "depth", "additions"});
+
+    for (const std::vector<std::int64_t>& args : shapes())
+        b->Args(args);
+}
+
+// Writes the document of each shape to the directory as corpus<i>.tex.
+// Returns false if a document cannot be written.
+bool write_corpora(const std::filesystem::path& directory)
+{
+    const std::vector<std::vector<std::int64_t> > args = shapes();
+
+    for (std::size_t i = 0; i != args.size(); ++i) {
+        const std::string document = generate(corpus(args[i]));
+        const std::filesystem::path fileName = directory / ("corpus" + std::to_string(i) + ".tex");
+        std::ofstream out{fileName, std::ios::binary};
+
+        if (!out.write(document.data(), static_cast<std::streamsize>(document.size()))) {
+            std::cerr << "error: failed to write " << fileName << '\n';
+            return false;
+        }
+    }
+
+    return true;
+}
+
+BENCHMARK(BM_Parse)->Apply(corpora);
+BENCHMARK(BM_Expand)->Apply(corpora);
+BENCHMARK(BM_Addition)->Apply(corpora);
+BENCHMARK(BM_Streaming)->Apply(corpora);
+
+// With --write-corpus=DIR, writes the documents the benchmarks run on to DIR
+// instead, e.g., to train profile-guided builds
+int main(int argc, char** argv)
+{
+    const std::string_view option{"--write-corpus="};
+
+    if (argc == 2 && std::string_view{argv[1]}.compare(0, option.size(), option) == 0)
+        return write_corpora(argv[1] + option.size()) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    benchmark::Initialize(&argc, argv);
+
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return EXIT_FAILURE;
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return EXIT_SUCCESS;
+}
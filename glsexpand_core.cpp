@@ -0,0 +1,1640 @@
+//
+// Copyright (c) 2019 Sergiu Deitsch <sergiu.deitsch@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation and/or
+// other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+// ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+#include "glsexpand_core.hpp"
+#include "glsexpand.hpp"
+
+// Lowercase letters whose uppercase counterpart is at a fixed distance. A
+// range either covers every code point or, with a stride of 2, every other
+// one starting with the first, as in Latin Extended-A where the cases
+// alternate.
+struct CaseRange
+{
+    char32_t first;
+    char32_t last;
+    unsigned stride;
+    std::int32_t delta;
+};
+
+// Letters of the Latin, Greek and Cyrillic scripts, sorted by code point
+constexpr CaseRange UppercaseRanges[] = {
+    {0x0061, 0x007A, 1, -32},   // a-z
+    {0x00E0, 0x00F6, 1, -32},   // Latin-1 Supplement
+    {0x00F8, 0x00FE, 1, -32},
+    {0x00FF, 0x00FF, 1, 121},   // y with diaeresis
+    {0x0101, 0x012F, 2, -1},    // Latin Extended-A
+    {0x0133, 0x0137, 2, -1},
+    {0x013A, 0x0148, 2, -1},
+    {0x014B, 0x0177, 2, -1},
+    {0x017A, 0x017E, 2, -1},
+    {0x03B1, 0x03C1, 1, -32},   // Greek
+    {0x03C2, 0x03C2, 1, -31},   // final sigma
+    {0x03C3, 0x03CB, 1, -32},
+    {0x0430, 0x044F, 1, -32},   // Cyrillic
+    {0x0450, 0x045F, 1, -80},
+    {0x0461, 0x0481, 2, -1},
+};
+
+char32_t to_uppercase(char32_t c) noexcept
+{
+    for (const CaseRange& range : UppercaseRanges) {
+        if (c < range.first)
+            break;
+
+        if (c <= range.last && (c - range.first) % range.stride == 0)
+            return static_cast<char32_t>(static_cast<std::int32_t>(c) + range.delta);
+    }
+
+    return c;
+}
+
+// Decodes the UTF-8 sequence at the start of value. Returns its length, or 0
+// if the sequence is invalid.
+std::size_t decode_utf8(std::string_view value, char32_t& c) noexcept
+{
+    const auto byte =
+        [value] (std::size_t i)
+        {
+            return static_cast<unsigned char>(value[i]);
+        };
+
+    const unsigned char lead = byte(0);
+    std::size_t size;
+
+    if (lead < 0x80)
+        size = 1;
+    else if ((lead & 0xE0) == 0xC0)
+        size = 2;
+    else if ((lead & 0xF0) == 0xE0)
+        size = 3;
+    else if ((lead & 0xF8) == 0xF0)
+        size = 4;
+    else
+        return 0;
+
+    if (value.size() < size)
+        return 0;
+
+    c = size == 1 ? lead : lead & (0x7F >> size);
+
+    for (std::size_t i = 1; i != size; ++i) {
+        if ((byte(i) & 0xC0) != 0x80)
+            return 0;
+
+        c = (c << 6) | (byte(i) & 0x3F);
+    }
+
+    return size;
+}
+
+void append_utf8(std::string& out, char32_t c)
+{
+    if (c < 0x80)
+        out.push_back(static_cast<char>(c));
+    else if (c < 0x800) {
+        out.push_back(static_cast<char>(0xC0 | (c >> 6)));
+        out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    }
+    else if (c < 0x10000) {
+        out.push_back(static_cast<char>(0xE0 | (c >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    }
+    else {
+        out.push_back(static_cast<char>(0xF0 | (c >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    }
+}
+
+// Appends the value with its first letter in uppercase. The value is taken
+// to be UTF-8; if it does not start with a valid sequence, it is appended
+// unchanged.
+std::string& make_uppercase(std::string& out, std::string_view value)
+{
+    char32_t c;
+    const std::size_t size = value.empty() ? 0 : decode_utf8(value, c);
+
+    if (size == 0)
+        return out.append(value);
+
+    append_utf8(out, to_uppercase(c));
+    return out.append(value.substr(size));
+}
+
+// How an abbreviation is rendered for each modifier combination, indexed by
+// the modifier flags. The first use is rendered as the description followed
+// by the short name in parentheses, any subsequent use as the short name
+// alone. Both take the same suffix.
+struct Form
+{
+    bool uppercase;
+    std::string_view suffix;
+};
+
+constexpr std::array<Form, ast::ModifiersMask + 1> Forms{{
+    {false, ""},    // None
+    {false, "s"},   // Plural
+    {true, ""},     // Uppercase
+    {true, "s"}     // Uppercase | Plural
+}};
+
+// Renders the expansion of an abbreviation for a modifier combination, either
+// for its first or for any subsequent use
+void render(std::string& out, const ast::Abbreviation& abbreviation, unsigned modifiers, bool used)
+{
+    const Form& form = Forms[modifiers & ast::ModifiersMask];
+    const std::string_view leading = used ? abbreviation.shortName : abbreviation.value;
+
+    if (form.uppercase)
+        make_uppercase(out, leading);
+    else
+        out.append(leading);
+
+    out.append(form.suffix);
+
+    if (!used)
+        out.append(" (").append(abbreviation.shortName).append(form.suffix).append(")");
+}
+
+namespace braces {
+
+const char* find_scalar(const char* first, const char* last) noexcept
+{
+    while (first != last && *first != '{' && *first != '}')
+        ++first;
+
+    return first;
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+const char* find_sse2(const char* first, const char* last) noexcept
+{
+    const __m128i open = _mm_set1_epi8('{');
+    const __m128i close = _mm_set1_epi8('}');
+
+    for (; last - first >= 16; first += 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+        const int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, open), _mm_cmpeq_epi8(chunk, close)));
+
+        if (mask != 0) {
+#ifdef _MSC_VER
+            unsigned long index;
+            _BitScanForward(&index, static_cast<unsigned long>(mask));
+            return first + index;
+#else
+            return first + __builtin_ctz(static_cast<unsigned>(mask));
+#endif // _MSC_VER
+        }
+    }
+
+    return find_scalar(first, last);
+}
+#endif // defined(__SSE2__) || defined(_M_X64)
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("avx2")))
+const char* find_avx2(const char* first, const char* last) noexcept
+{
+    const __m256i open = _mm256_set1_epi8('{');
+    const __m256i close = _mm256_set1_epi8('}');
+
+    for (; last - first >= 32; first += 32) {
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+        const auto mask = static_cast<unsigned>(_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, open), _mm256_cmpeq_epi8(chunk, close))));
+
+        if (mask != 0)
+            return first + __builtin_ctz(mask);
+    }
+
+    return find_sse2(first, last);
+}
+#endif // defined(__GNUC__) && defined(__x86_64__)
+
+#if defined(__ARM_NEON)
+const char* find_neon(const char* first, const char* last) noexcept
+{
+    const uint8x16_t open = vdupq_n_u8('{');
+    const uint8x16_t close = vdupq_n_u8('}');
+
+    for (; last - first >= 16; first += 16) {
+        const uint8x16_t chunk = vld1q_u8(reinterpret_cast<const std::uint8_t*>(first));
+        const uint8x16_t matches = vorrq_u8(vceqq_u8(chunk, open), vceqq_u8(chunk, close));
+        // Narrow each byte to a nibble to obtain a 64 bit mask
+        const std::uint64_t mask = vget_lane_u64(
+            vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(matches), 4)), 0);
+
+        if (mask != 0)
+            return first + __builtin_ctzll(mask) / 4;
+    }
+
+    return find_scalar(first, last);
+}
+#endif // defined(__ARM_NEON)
+
+using Finder = const char* (*)(const char*, const char*) noexcept;
+
+// Picks the widest implementation the processor supports
+Finder select() noexcept
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        return find_avx2;
+#endif // defined(__GNUC__) && defined(__x86_64__)
+
+#if defined(__SSE2__) || defined(_M_X64)
+    return find_sse2;
+#elif defined(__ARM_NEON)
+    return find_neon;
+#else
+    return find_scalar;
+#endif
+}
+
+const char* find(const char* first, const char* last) noexcept
+{
+    static const Finder finder = select();
+    return finder(first, last);
+}
+
+const char* match(const char* first, const char* last) noexcept
+{
+    std::size_t depth = 1;
+
+    for (const char* pos = find(first, last); pos != last; pos = find(pos + 1, last)) {
+        if (*pos == '{')
+            ++depth;
+        else if (depth > 1 && pos[-1] == '{')
+            return nullptr;
+        else if (--depth == 0)
+            return pos;
+    }
+
+    return nullptr;
+}
+
+} // namespace braces
+
+namespace newlines {
+
+// The offsets are relative to base; first to last is the part to scan
+void index_scalar(const char* base, const char* first, const char* last, std::vector<std::size_t>& offsets)
+{
+    while ((first = static_cast<const char*>(std::memchr(first, '\n', static_cast<std::size_t>(last - first)))) != nullptr)
+        offsets.push_back(static_cast<std::size_t>(first++ - base));
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+void index_sse2(const char* base, const char* first, const char* last, std::vector<std::size_t>& offsets)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    for (; last - first >= 16; first += 16) {
+        const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+        auto mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+
+        for (; mask != 0; mask &= mask - 1) {
+#ifdef _MSC_VER
+            unsigned long index;
+            _BitScanForward(&index, static_cast<unsigned long>(mask));
+#else
+            const unsigned index = static_cast<unsigned>(__builtin_ctz(mask));
+#endif // _MSC_VER
+            offsets.push_back(static_cast<std::size_t>(first - base) + index);
+        }
+    }
+
+    index_scalar(base, first, last, offsets);
+}
+#endif // defined(__SSE2__) || defined(_M_X64)
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("avx2")))
+void index_avx2(const char* base, const char* first, const char* last, std::vector<std::size_t>& offsets)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+
+    for (; last - first >= 32; first += 32) {
+        const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first));
+        auto mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline)));
+
+        for (; mask != 0; mask &= mask - 1)
+            offsets.push_back(static_cast<std::size_t>(first - base) + static_cast<unsigned>(__builtin_ctz(mask)));
+    }
+
+    index_sse2(base, first, last, offsets);
+}
+#endif // defined(__GNUC__) && defined(__x86_64__)
+
+#if defined(__ARM_NEON)
+void index_neon(const char* base, const char* first, const char* last, std::vector<std::size_t>& offsets)
+{
+    const uint8x16_t newline = vdupq_n_u8('\n');
+
+    for (; last - first >= 16; first += 16) {
+        const uint8x16_t chunk = vld1q_u8(reinterpret_cast<const std::uint8_t*>(first));
+        // Narrow each byte to a nibble to obtain a 64 bit mask
+        std::uint64_t mask = vget_lane_u64(
+            vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(vceqq_u8(chunk, newline)), 4)), 0);
+
+        while (mask != 0) {
+            const unsigned nibble = static_cast<unsigned>(__builtin_ctzll(mask)) / 4;
+
+            offsets.push_back(static_cast<std::size_t>(first - base) + nibble);
+            mask &= ~(std::uint64_t{0xF} << (4 * nibble));
+        }
+    }
+
+    index_scalar(base, first, last, offsets);
+}
+#endif // defined(__ARM_NEON)
+
+using Indexer = void (*)(const char*, const char*, const char*, std::vector<std::size_t>&);
+
+// Picks the widest implementation the processor supports
+Indexer select() noexcept
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        return index_avx2;
+#endif // defined(__GNUC__) && defined(__x86_64__)
+
+#if defined(__SSE2__) || defined(_M_X64)
+    return index_sse2;
+#elif defined(__ARM_NEON)
+    return index_neon;
+#else
+    return index_scalar;
+#endif
+}
+
+std::vector<std::size_t> index(const char* first, const char* last)
+{
+    static const Indexer indexer = select();
+    std::vector<std::size_t> offsets;
+
+    indexer(first, first, last, offsets);
+    return offsets;
+}
+
+} // namespace newlines
+
+void Dictionary::finalize()
+{
+    if (!offsets_.empty()) {
+        offsets_.pop_back();
+        segmentOffsets_.pop_back();
+    }
+
+    // The adopted definitions are rendered already
+    offsets_.reserve(Variants * (entries_.size() - adopted_) + 1);
+    segmentOffsets_.reserve(Variants * (entries_.size() - adopted_) + 1);
+
+    for (std::size_t i = adopted_ + offsets_.size() / Variants; i != entries_.size(); ++i) {
+        const ast::Abbreviation& abbreviation = entries_[i];
+        const auto refers =
+            [] (std::string_view field)
+            {
+                return gls::plain_parser::find_command(field.data(), field.data() + field.size())
+                    != field.data() + field.size();
+            };
+
+        if (refers(abbreviation.value) || refers(abbreviation.shortName)) {
+            renderSegments(abbreviation);
+            continue;
+        }
+
+        for (unsigned modifiers = 0; modifiers <= ast::ModifiersMask; ++modifiers)
+            for (bool used : {false, true}) {
+                offsets_.push_back(expansions_.size());
+                segmentOffsets_.push_back(segments_.size());
+                render(expansions_, abbreviation, modifiers, used);
+            }
+    }
+
+    offsets_.push_back(expansions_.size());
+    segmentOffsets_.push_back(segments_.size());
+}
+
+void Dictionary::adopt(const std::vector<ast::Abbreviation>& definitions, const Tables& tables)
+{
+    entries_ = definitions;
+    slots_.assign(tables.slots, tables.slots + tables.slotCount);
+    adopted_ = entries_.size();
+    adoptedOffsets_ = tables.offsets;
+    adoptedExpansions_ = tables.expansions;
+}
+
+void Dictionary::renderSegments(const ast::Abbreviation& abbreviation)
+{
+    // Splits the field into text and references; a field that cannot be
+    // parsed is taken as text
+    const auto split =
+        [] (std::string_view field)
+        {
+            using boost::spirit::x3::with;
+
+            const auto parser = with<gls::dictionary_tag>(static_cast<const Dictionary*>(nullptr))[gls::gls_token];
+            std::vector<ast::Entry> parts;
+
+            for (const char* pos = field.data(); pos != field.data() + field.size(); ) {
+                if (!boost::spirit::x3::parse(pos, field.data() + field.size(), parser, parts.emplace_back()))
+                    return std::vector<ast::Entry>{ast::Entry{field}};
+            }
+
+            return parts;
+        };
+
+    const std::vector<ast::Entry> value = split(abbreviation.value);
+    const std::vector<ast::Entry> shortName = split(abbreviation.shortName);
+
+    const auto text =
+        [this] (std::string_view part, bool uppercase)
+        {
+            const std::size_t offset = expansions_.size();
+
+            if (uppercase)
+                make_uppercase(expansions_, part);
+            else
+                expansions_.append(part);
+
+            // Extend the preceding text instead of starting a new segment
+            if (segments_.size() > segmentOffsets_.back() && segments_.back().name.empty())
+                segments_.back().size += expansions_.size() - offset;
+            else
+                segments_.push_back(Segment{offset, expansions_.size() - offset, {}, 0});
+        };
+
+    const auto append =
+        [&text, this] (const std::vector<ast::Entry>& parts, bool uppercase)
+        {
+            for (const ast::Entry& part : parts) {
+                if (const auto* value = boost::get<std::string_view>(&part.get())) {
+                    if (!value->empty()) {
+                        text(*value, uppercase);
+                        uppercase = false;
+                    }
+                }
+                else if (const auto* value = boost::get<ast::Reference>(&part.get())) {
+                    segments_.push_back(Segment{0, 0, value->name, value->flags | (uppercase ? ast::Uppercase : 0)});
+                    uppercase = false;
+                }
+            }
+        };
+
+    for (unsigned modifiers = 0; modifiers <= ast::ModifiersMask; ++modifiers)
+        for (bool used : {false, true}) {
+            const Form& form = Forms[modifiers];
+
+            offsets_.push_back(expansions_.size());
+            segmentOffsets_.push_back(segments_.size());
+
+            append(used ? shortName : value, form.uppercase);
+            text(form.suffix, false);
+
+            if (!used) {
+                text(" (", false);
+                append(shortName, false);
+                text(form.suffix, false);
+                text(")", false);
+            }
+        }
+}
+
+// Collects the pieces of the expansion; active holds the definitions being
+// expanded to detect cycles and marked those that became used
+void collect_expansion(const Dictionary& definitions, std::size_t index, unsigned flags,
+    std::vector<bool>& seen, std::vector<std::string_view>& pieces, std::vector<std::size_t>& active,
+    std::vector<std::size_t>& marked)
+{
+    const bool used = seen[index] & ((flags & ast::First) == 0);
+    const auto [first, last] = definitions.segments(index, flags, used);
+
+    if (first == last)
+        pieces.push_back(definitions.expansion(index, flags, used));
+    else {
+        if (std::find(active.begin(), active.end(), index) != active.end())
+            throw std::runtime_error("cyclic definition of " + std::string{definitions[index].name});
+
+        active.push_back(index);
+
+        for (const Dictionary::Segment* segment = first; segment != last; ++segment) {
+            if (segment->name.empty()) {
+                pieces.push_back(definitions.text(*segment));
+                continue;
+            }
+
+            const std::size_t nested = definitions.find(segment->name);
+
+            if (nested == Dictionary::npos)
+                throw std::runtime_error("missing definition for " + std::string{segment->name});
+
+            collect_expansion(definitions, nested, segment->flags, seen, pieces, active, marked);
+        }
+
+        active.pop_back();
+    }
+
+    if (!seen[index]) {
+        seen[index] = true;
+        marked.push_back(index);
+    }
+}
+
+void collect_expansion(const Dictionary& definitions, std::size_t index, unsigned flags,
+    std::vector<bool>& seen, std::vector<std::string_view>& pieces)
+{
+    std::vector<std::size_t> active;
+    std::vector<std::size_t> marked;
+
+    try {
+        collect_expansion(definitions, index, flags, seen, pieces, active, marked);
+    }
+    catch (const std::runtime_error&) {
+        for (std::size_t i : marked)
+            seen[i] = false;
+
+        pieces.clear();
+        throw;
+    }
+}
+
+Statistics statistics;
+
+void write_report(const std::string& message)
+{
+    static std::mutex mutex;
+
+    std::lock_guard<std::mutex> lock{mutex};
+    std::cerr << message;
+}
+
+bool parse_entries(const char*& pos, const char* boundary, const char* last, std::vector<ast::Entry>& entries)
+{
+    using boost::spirit::x3::with;
+
+    const auto parser = with<gls::dictionary_tag>(static_cast<const Dictionary*>(nullptr))[gls::gls_token];
+
+    while (pos < boundary) {
+        entries.emplace_back();
+
+        if (!boost::spirit::x3::parse(pos, last, parser, entries.back()))
+            return false;
+    }
+
+    return true;
+}
+
+// Estimate of the bytes of input per entry used to reserve the entries up
+// front. Prose has a command every few dozen characters; overestimating the
+// count costs less than growing the entries repeatedly.
+constexpr std::size_t BytesPerEntry = 64;
+
+bool parse_entries(const char* first, const char* last, unsigned jobs, std::vector<ast::Entry>& entries)
+{
+    const auto size = static_cast<std::size_t>(last - first);
+    const std::size_t count = std::min<std::size_t>(jobs, size / MinChunkSize);
+
+    std::vector<const char*> boundaries{first};
+
+    for (std::size_t i = 1; i < count; ++i) {
+        const char* pos = gls::plain_parser::find_command(first + i * (size / count), last);
+
+        if (pos != last && pos > boundaries.back())
+            boundaries.push_back(pos);
+    }
+
+    boundaries.push_back(last);
+
+    const std::size_t chunks = boundaries.size() - 1;
+
+    std::vector<std::vector<ast::Entry> > parsed(chunks);
+    std::vector<const char*> ends(chunks);
+    std::vector<char> succeeded(chunks);
+
+    parallel_for(chunks, jobs,
+        [&] (std::size_t i)
+        {
+            const char* pos = boundaries[i];
+            // The first chunk is reserved for the whole document to become
+            // its entries
+            parsed[i].reserve(static_cast<std::size_t>((i == 0 ? last : boundaries[i + 1]) - pos) / BytesPerEntry);
+            succeeded[i] = parse_entries(pos, boundaries[i + 1], last, parsed[i]);
+            ends[i] = pos;
+        }
+    );
+
+    const char* pos = first;
+
+    for (std::size_t i = 0; i != chunks; ++i) {
+        if (pos != boundaries[i]) {
+            // The chunk does not start at an entry: redo the rest of it
+            parsed[i].clear();
+            succeeded[i] = parse_entries(pos, boundaries[i + 1], last, parsed[i]);
+            ends[i] = pos;
+        }
+
+        if (!succeeded[i])
+            return false;
+
+        pos = ends[i];
+    }
+
+    // Existing entries followed by those of all chunks
+    std::size_t total = entries.size();
+
+    for (const std::vector<ast::Entry>& chunk : parsed)
+        total += chunk.size();
+
+    auto chunk = parsed.begin();
+
+    // Take over the storage of the first chunk instead of copying it
+    if (entries.empty())
+        entries.swap(*chunk++);
+
+    entries.reserve(total);
+
+    for (; chunk != parsed.end(); ++chunk)
+        std::move(chunk->begin(), chunk->end(), std::back_inserter(entries));
+
+    return true;
+}
+
+std::size_t expand_parallel(const std::vector<ast::Entry>& entries, const Dictionary& definitions,
+    std::vector<bool>& seen, unsigned jobs, std::string& output, Counters& counters)
+{
+    seen.resize(definitions.size());
+
+    const std::size_t slices = std::max(1u, jobs);
+    const std::size_t sliceSize = (entries.size() + slices - 1) / slices;
+
+    const auto slice =
+        [&entries, sliceSize] (std::size_t i)
+        {
+            const std::size_t first = std::min(i * sliceSize, entries.size());
+            return std::make_pair(first, std::min(first + sliceSize, entries.size()));
+        };
+
+    const auto reference =
+        [&entries] (std::size_t i)
+        {
+            return boost::get<ast::Reference>(&entries[i].get());
+        };
+
+    std::vector<std::size_t> ids(entries.size(), Dictionary::npos);
+    std::vector<std::size_t> missing(slices, entries.size());
+
+    parallel_for(slices, jobs,
+        [&] (std::size_t s)
+        {
+            const auto [first, last] = slice(s);
+
+            for (std::size_t i = first; i != last; ++i)
+                if (const ast::Reference* value = reference(i)) {
+                    ids[i] = value->id != ast::Unresolved ? value->id : definitions.find(value->name);
+
+                    if (ids[i] == Dictionary::npos && missing[s] == entries.size())
+                        missing[s] = i;
+                }
+        }
+    );
+
+    const std::size_t undefined = *std::min_element(missing.begin(), missing.end());
+
+    if (undefined != entries.size())
+        return undefined;
+
+    std::vector<char> used(entries.size());
+
+    for (std::size_t i = 0; i != entries.size(); ++i)
+        if (ids[i] != Dictionary::npos) {
+            const unsigned flags = reference(i)->flags;
+
+            used[i] = seen[ids[i]] & ((flags & ast::First) == 0);
+            seen[ids[i]] = true;
+            ++counters.references[flags];
+        }
+        else if (boost::get<std::string_view>(&entries[i].get()) != nullptr)
+            ++counters.textRuns;
+
+    const auto render =
+        [&] (std::size_t i) -> std::string_view
+        {
+            if (const ast::Reference* value = reference(i))
+                return definitions.expansion(ids[i], value->flags, used[i]);
+
+            if (const auto* text = boost::get<std::string_view>(&entries[i].get()))
+                return *text;
+
+            return {};
+        };
+
+    std::vector<std::size_t> offsets(slices + 1);
+
+    parallel_for(slices, jobs,
+        [&] (std::size_t s)
+        {
+            const auto [first, last] = slice(s);
+
+            for (std::size_t i = first; i != last; ++i)
+                offsets[s + 1] += render(i).size();
+        }
+    );
+
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    output.resize(offsets.back());
+
+    parallel_for(slices, jobs,
+        [&] (std::size_t s)
+        {
+            const auto [first, last] = slice(s);
+            char* pos = output.data() + offsets[s];
+
+            for (std::size_t i = first; i != last; ++i) {
+                const std::string_view value = render(i);
+                pos = std::copy(value.begin(), value.end(), pos);
+            }
+        }
+    );
+
+    return entries.size();
+}
+
+std::uint64_t hash_bytes(std::string_view data, std::uint64_t hash) noexcept
+{
+    for (char c : data) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+std::uint64_t hash_seen(const std::vector<bool>& seen, std::uint64_t hash) noexcept
+{
+    for (bool used : seen) {
+        hash ^= used ? 2 : 1;
+        hash *= 1099511628211ull;
+    }
+
+    return hash;
+}
+
+// A compiled glossary holds the definitions of glossaries in a form that is
+// used in place once the file is mapped. The header gives the number of
+// definitions, the size of the slot table and of the rendered expansions,
+// and the hash function the slot table depends on. A table with the offset and size of the name, short name and
+// description of each definition in the order of the dictionary follows.
+// Then come the slot table of the dictionary, the offsets of the rendered
+// variants of each definition, the rendered expansions, and finally the
+// string table the definitions refer to. Loading it as the first glossary
+// requires neither parsing nor hashing nor rendering the definitions.
+// Definitions referring to other abbreviations are rendered into segments
+// with names instead; their glossary is stored without the slot table and
+// the expansions, and its definitions are added one by one on loading.
+constexpr std::uint64_t GlossaryMagic = 0x32303043534C47ull; // "GLSC002"
+
+// Identifies the hash function the slot table was built with
+std::uint64_t slot_hash() noexcept
+{
+    return static_cast<std::uint64_t>(std::hash<std::string_view>{}("glsexpand"));
+}
+
+// Returns whether the data is a compiled glossary
+bool is_compiled_glossary(const char* first, const char* last) noexcept
+{
+    std::uint64_t magic;
+
+    if (static_cast<std::size_t>(last - first) < sizeof magic)
+        return false;
+
+    std::memcpy(&magic, first, sizeof magic);
+    return magic == GlossaryMagic;
+}
+
+// Appends the definitions of the compiled glossary as views into the data and
+// returns the tables stored along with them, if they apply to this build.
+// Returns false if the data is not a valid compiled glossary.
+bool read_compiled_glossary(const char* first, const char* last, std::vector<ast::Abbreviation>& definitions,
+    std::optional<Dictionary::Tables>& tables)
+{
+    constexpr std::size_t Fields = 6;
+
+    std::uint64_t header[5];
+
+    if (static_cast<std::size_t>(last - first) < sizeof header)
+        return false;
+
+    std::memcpy(header, first, sizeof header);
+
+    const std::uint64_t count = header[1];
+    const std::uint64_t slotCount = header[2];
+    const std::uint64_t rendered = header[3];
+    const char* table = first + sizeof header;
+    auto remaining = static_cast<std::uint64_t>(last - table);
+
+    const auto take =
+        [&remaining] (std::uint64_t count, std::uint64_t size)
+        {
+            if (count > remaining / size)
+                return false;
+
+            remaining -= count * size;
+            return true;
+        };
+
+    // The slots are padded to the alignment of the offsets
+    const std::uint64_t slotBytes = (slotCount * sizeof(std::uint32_t) + 7) / 8 * 8;
+    const std::uint64_t offsetCount = slotCount == 0 ? 0 : Dictionary::Variants * count + 1;
+
+    if (header[0] != GlossaryMagic || !take(count, Fields * sizeof(std::uint64_t)) ||
+        slotCount > std::numeric_limits<std::uint64_t>::max() / sizeof(std::uint32_t) || !take(slotBytes, 1) ||
+        !take(offsetCount, sizeof(std::uint64_t)) || !take(rendered, 1))
+        return false;
+
+    const char* slots = table + count * Fields * sizeof(std::uint64_t);
+    const char* offsets = slots + slotBytes;
+    const char* expansions = offsets + offsetCount * sizeof(std::uint64_t);
+    const char* strings = expansions + rendered;
+    const auto size = static_cast<std::uint64_t>(last - strings);
+
+    definitions.reserve(definitions.size() + static_cast<std::size_t>(count));
+
+    for (std::uint64_t i = 0; i != count; ++i) {
+        std::uint64_t entry[Fields];
+        std::memcpy(entry, table + i * sizeof entry, sizeof entry);
+
+        std::string_view fields[Fields / 2];
+
+        for (std::size_t j = 0; j != Fields / 2; ++j) {
+            const std::uint64_t offset = entry[2 * j];
+            const std::uint64_t length = entry[2 * j + 1];
+
+            if (offset > size || length > size - offset)
+                return false;
+
+            fields[j] = std::string_view(strings + offset, static_cast<std::size_t>(length));
+        }
+
+        definitions.push_back(ast::Abbreviation{fields[0], fields[1], fields[2]});
+    }
+
+    // The tables are used as they are, so they must have been written by a
+    // build hashing alike, and the offsets must be aligned and as wide
+    const auto aligned =
+        [] (const char* pos, std::size_t alignment)
+        {
+            return reinterpret_cast<std::uintptr_t>(pos) % alignment == 0;
+        };
+
+    if (slotCount == 0 || header[4] != slot_hash() || sizeof(std::size_t) != sizeof(std::uint64_t) ||
+        !aligned(slots, alignof(std::uint32_t)) || !aligned(offsets, alignof(std::size_t)))
+        return true;
+
+    Dictionary::Tables result{reinterpret_cast<const std::uint32_t*>(slots), static_cast<std::size_t>(slotCount),
+        reinterpret_cast<const std::size_t*>(offsets), std::string_view(expansions, static_cast<std::size_t>(rendered))};
+
+    // Every lookup must end at an empty slot, and every variant must be
+    // inside the expansions
+    std::size_t used = 0;
+
+    for (std::size_t i = 0; i != result.slotCount; ++i) {
+        if (result.slots[i] > count)
+            return false;
+
+        used += result.slots[i] != 0;
+    }
+
+    if ((result.slotCount & (result.slotCount - 1)) != 0 || used != count || result.slotCount < 2 * count ||
+        result.offsets[0] != 0 || result.offsets[offsetCount - 1] != rendered)
+        return false;
+
+    for (std::size_t i = 1; i != offsetCount; ++i)
+        if (result.offsets[i] < result.offsets[i - 1])
+            return false;
+
+    tables = result;
+    return true;
+}
+
+bool write_compiled_glossary(const std::string& fileName, const Dictionary& dictionary)
+{
+    std::string data;
+    std::string strings;
+
+    const auto write =
+        [&data] (std::uint64_t value)
+        {
+            data.append(reinterpret_cast<const char*>(&value), sizeof value);
+        };
+
+    // Segments refer to names and cannot be stored as they are
+    const std::vector<std::uint32_t> none;
+    const std::vector<std::uint32_t>& slots = dictionary.nested() ? none : dictionary.slots();
+    // The variants in the order of Dictionary::variant()
+    std::vector<std::size_t> offsets;
+    std::string expansions;
+
+    if (!slots.empty()) {
+        offsets.reserve(Dictionary::Variants * dictionary.size() + 1);
+        expansions.reserve(dictionary.rendered());
+
+        for (std::size_t index = 0; index != dictionary.size(); ++index)
+            for (unsigned modifiers = 0; modifiers <= ast::ModifiersMask; ++modifiers)
+                for (bool used : {false, true}) {
+                    offsets.push_back(expansions.size());
+                    expansions.append(dictionary.expansion(index, modifiers, used));
+                }
+
+        offsets.push_back(expansions.size());
+    }
+
+    write(GlossaryMagic);
+    write(dictionary.size());
+    write(slots.size());
+    write(expansions.size());
+    write(slot_hash());
+
+    for (std::size_t index = 0; index != dictionary.size(); ++index) {
+        const ast::Abbreviation& definition = dictionary[index];
+
+        for (std::string_view field : {definition.name, definition.shortName, definition.value}) {
+            write(strings.size());
+            write(field.size());
+            strings.append(field);
+        }
+    }
+
+    data.append(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(std::uint32_t));
+    data.resize((data.size() + 7) / 8 * 8);
+
+    for (std::size_t offset : offsets)
+        write(offset);
+
+    data.append(expansions);
+    data.append(strings);
+
+    std::FILE* file = std::fopen(fileName.c_str(), "wb");
+    bool succeeded = file != nullptr;
+
+    if (file != nullptr) {
+        succeeded = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+        succeeded &= std::fclose(file) == 0;
+    }
+
+    if (!succeeded)
+        report("error: failed to write the compiled glossary ", std::quoted(fileName));
+
+    return succeeded;
+}
+
+bool open(const std::string& fileName, bool resident, Source& source)
+{
+    try {
+        source.input = std::make_unique<Input>(fileName.c_str(), !resident);
+    }
+    catch (const std::exception&) {
+        report("error: failed to open input ", std::quoted(fileName));
+        return false;
+    }
+
+    return true;
+}
+
+bool load(const std::string& fileName, unsigned jobs, const Cache* cache, bool resident, bool recover,
+    bool glossary, Source& source)
+{
+    if (!source.input && !open(fileName, resident, source))
+        return false;
+
+    CollectDefinitions collect;
+    const Input& in = *source.input;
+
+    const auto view =
+        [&in] (std::uint64_t offset, std::uint64_t size)
+        {
+            return std::string_view(in.begin() + offset, static_cast<std::size_t>(size));
+        };
+
+    const auto offset =
+        [&in] (std::string_view value)
+        {
+            return static_cast<std::uint64_t>(value.data() - in.begin());
+        };
+
+    // A compiled glossary is read without parsing, so there is nothing to
+    // cache about it
+    const bool compiled = is_compiled_glossary(in.begin(), in.end());
+
+    if ((cache != nullptr || resident) && fileName != "-" && !compiled) {
+        const std::uint64_t content = hash_bytes(std::string_view(in.begin(), static_cast<std::size_t>(in.end() - in.begin())));
+        source.record.emplace();
+
+        const auto size = static_cast<std::uint64_t>(in.end() - in.begin());
+        const auto inside =
+            [size] (const std::array<std::uint64_t, 6>& d)
+            {
+                for (std::size_t i = 0; i != d.size(); i += 2)
+                    if (d[i] > size || d[i + 1] > size - d[i])
+                        return false;
+
+                return true;
+            };
+
+        if (cache != nullptr && cache->find(fileName, *source.record) && source.record->content == content &&
+            std::all_of(source.record->definitions.begin(), source.record->definitions.end(), inside)) {
+            for (const auto& d : source.record->definitions)
+                source.definitions.push_back(ast::Abbreviation{view(d[0], d[1]), view(d[2], d[3]), view(d[4], d[5])});
+
+            return true;
+        }
+
+        // Start over with an empty record
+        source.record.emplace();
+        source.record->content = content;
+    }
+
+    if (compiled) {
+        if (!glossary) {
+            report("error: the compiled glossary ", std::quoted(fileName), " can only be passed to --glossary");
+            return false;
+        }
+
+        if (!read_compiled_glossary(in.begin(), in.end(), collect.definitions, source.tables)) {
+            report("error: invalid compiled glossary ", std::quoted(fileName));
+            return false;
+        }
+    }
+    else {
+        GLSEXPAND_TRACE_SCOPE(parse);
+
+        if (jobs > 1 && static_cast<std::size_t>(in.end() - in.begin()) >= 2 * MinChunkSize) {
+            // Parse once in parallel and keep the entries for the expansion.
+            // The errors, if any, are located by parsing once more below.
+            source.entries.emplace();
+
+            if (!parse_entries(in.begin(), in.end(), jobs, *source.entries))
+                source.entries.reset();
+        }
+
+        Diagnostics diagnostics{in.begin(), in.end(), recover};
+
+        if (source.entries) {
+            for (ast::Entry& entry : *source.entries)
+                entry.apply_visitor(collect);
+        }
+        else if (!for_each_entry(in.begin(), in.end(), nullptr, collect, &diagnostics)) {
+            diagnostics.report(fileName);
+            return false;
+        }
+
+        if (!diagnostics.empty()) {
+            diagnostics.report(fileName);
+            source.errors = diagnostics.size();
+        }
+    }
+
+    source.definitions = std::move(collect.definitions);
+
+    if (source.record)
+        for (const ast::Abbreviation& d : source.definitions)
+            source.record->definitions.push_back({
+                offset(d.name), d.name.size(), offset(d.shortName), d.shortName.size(),
+                offset(d.value), d.value.size()});
+
+    return true;
+}
+
+// Largest document expanded in memory while its definitions are collected.
+// Nothing can be written before the document is known to define everything
+// before its use, so this bounds the memory held by the expansion. Larger
+// documents are parsed twice, but streamed to the output.
+constexpr std::size_t MaxSinglePassSize = 2 * MinChunkSize;
+
+bool load_expanded(Source& source, Dictionary definitions)
+{
+    GLSEXPAND_TRACE_SCOPE(parse);
+
+    const Input& in = *source.input;
+
+    // A compiled glossary is rejected by load()
+    if (static_cast<std::size_t>(in.end() - in.begin()) > MaxSinglePassSize ||
+        is_compiled_glossary(in.begin(), in.end()))
+        return false;
+
+    StringSink out;
+    std::vector<bool> seen;
+    ExpandDefined<StringSink> e{out, definitions, seen};
+
+    try {
+        if (!for_each_entry(in.begin(), in.end(), nullptr, e))
+            return false;
+    }
+    catch (const ExpandDefined<StringSink>::Deferred&) {
+        return false;
+    }
+    catch (const std::runtime_error&) {
+        // Reported by the expansion of the loaded document
+        return false;
+    }
+
+    source.definitions = std::move(e.collected);
+    source.expansion.emplace();
+    source.expansion->text = std::move(out.text);
+    source.expansion->seen = std::move(seen);
+    source.expansion->counters = e.counters;
+    source.expansion->definitions.emplace(std::move(definitions));
+
+    return true;
+}
+
+bool expand_file(const std::string& fileName, Source& source, const Environment& environment,
+    std::vector<bool>& seen, unsigned jobs, std::FILE* file)
+{
+    // Unmodified text and the expansions are passed through without copying
+    // where possible
+#ifdef HAVE_WRITEV
+    GatherWriter out{fileno(file)};
+#else
+    OutputBuffer out{file};
+#endif // HAVE_WRITEV
+
+    return expand(fileName, source, environment, seen, jobs, out);
+}
+
+// Bounded queue of input blocks between the reader and the expansion. Either
+// side may close the queue: the reader at the end of the input, and the
+// expansion if it gives up, which makes the reader stop as well.
+class BlockQueue
+{
+public:
+    explicit BlockQueue(std::size_t capacity)
+        : capacity_(capacity)
+    {
+    }
+
+    // Waits for room for the block. Returns false if the queue was closed.
+    bool push(std::string block)
+    {
+        std::unique_lock<std::mutex> lock{mutex_};
+        notFull_.wait(lock, [this] { return closed_ || blocks_.size() < capacity_; });
+
+        if (closed_)
+            return false;
+
+        blocks_.push_back(std::move(block));
+        notEmpty_.notify_one();
+
+        return true;
+    }
+
+    // Waits for the next block. Returns false once the queue is closed and no
+    // blocks are left.
+    bool pop(std::string& block)
+    {
+        std::unique_lock<std::mutex> lock{mutex_};
+        notEmpty_.wait(lock, [this] { return closed_ || !blocks_.empty(); });
+
+        if (blocks_.empty())
+            return false;
+
+        block = std::move(blocks_.front());
+        blocks_.pop_front();
+        notFull_.notify_one();
+
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock{mutex_};
+
+        closed_ = true;
+        notFull_.notify_all();
+        notEmpty_.notify_all();
+    }
+
+private:
+    std::size_t capacity_;
+    std::deque<std::string> blocks_;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable notFull_;
+    std::condition_variable notEmpty_;
+};
+
+// Passes the entries of a document read in blocks on to ExpandDefined. The
+// definitions are copied since the input they refer to is discarded block by
+// block.
+template<class Sink>
+struct ExpandStreamed
+{
+    using result_type = void;
+
+    void operator()(std::string_view value)
+    {
+        expand(value);
+    }
+
+    void operator()(const ast::Reference& value)
+    {
+        expand(value);
+    }
+
+    void operator()(const ast::Abbreviation& value)
+    {
+        const std::string_view text = storage.emplace_back(
+            std::string{value.name}.append(value.shortName).append(value.value));
+
+        expand(ast::Abbreviation{
+            text.substr(0, value.name.size()),
+            text.substr(value.name.size(), value.shortName.size()),
+            text.substr(value.name.size() + value.shortName.size())});
+
+        if (value.value.empty())
+            report("warning: description of ", value.name, " is empty");
+    }
+
+    ExpandDefined<Sink>& expand;
+    std::deque<std::string> storage;
+};
+
+// Size of the blocks the input is read in when streaming and their number
+// queued at most
+constexpr std::size_t StreamBlockSize = 1 << 16;
+constexpr std::size_t StreamQueueSize = 4;
+
+bool expand_stream(const std::string& fileName, Dictionary definitions, std::FILE* output)
+{
+    GLSEXPAND_TRACE_SCOPE(expand);
+
+    std::FILE* file = fileName == "-" ? stdin : std::fopen(fileName.c_str(), "rb");
+
+    if (file == nullptr) {
+        report("error: failed to open input ", std::quoted(fileName));
+        return false;
+    }
+
+    BlockQueue queue{StreamQueueSize};
+    bool readFailed = false;
+
+    std::thread reader{
+        [&]
+        {
+            for (;;) {
+                std::string block(StreamBlockSize, '\0');
+#ifdef HAVE_UNISTD_H
+                // Pass on whatever is available instead of waiting for a full
+                // block, e.g., from a pipe
+                const ssize_t n = ::read(fileno(file), block.data(), block.size());
+
+                if (n < 0 && errno == EINTR)
+                    continue;
+
+                readFailed = n < 0;
+                block.resize(n > 0 ? static_cast<std::size_t>(n) : 0);
+#else
+                block.resize(std::fread(block.data(), 1, block.size(), file));
+                readFailed = std::ferror(file) != 0;
+#endif // HAVE_UNISTD_H
+
+                if (block.empty() || !queue.push(std::move(block)))
+                    break;
+            }
+
+            queue.close();
+        }
+    };
+
+    // Expansions are copied to the output since adding definitions may
+    // render them anew
+    OutputBuffer buffered{output};
+    CountingSink<OutputBuffer> out{buffered};
+    AdditionFilter filter{out};
+    std::vector<bool> seen;
+    ExpandDefined<decltype(filter)> e{filter, definitions, seen};
+    ExpandStreamed<decltype(filter)> streamed{e};
+
+    const auto parser =
+        boost::spirit::x3::with<gls::dictionary_tag>(static_cast<const Dictionary*>(nullptr))[gls::gls_token];
+
+    // Longest prefix of a command that may be cut off at the end of a block
+    constexpr std::size_t CommandPrefix = sizeof "\\newacronym" - 1;
+
+    std::string buffer;
+    std::string block;
+    bool succeeded = true;
+
+    try {
+        for (bool end = false; !end; ) {
+            end = !queue.pop(block);
+            buffer.append(block);
+            block.clear();
+
+            const char* first = buffer.data();
+            const char* last = first + buffer.size();
+
+            while (first != last) {
+                const char* pos = first;
+                ast::Entry entry;
+
+                // An entry that fails or extends to the end of the block may
+                // continue in the next one
+                if (!boost::spirit::x3::parse(pos, last, parser, entry) || (pos == last && !end)) {
+                    const auto* text = boost::get<std::string_view>(&entry.get());
+
+                    if (pos == last && text != nullptr && !text->empty()) {
+                        // Keep only what may be the start of a command
+                        const std::size_t size = text->size();
+                        const std::size_t tail = text->substr(size - std::min(size, CommandPrefix)).rfind('\\');
+                        const std::size_t cut = tail == std::string_view::npos
+                            ? size : size - std::min(size, CommandPrefix) + tail;
+
+                        streamed(text->substr(0, cut));
+                        first += cut;
+                    }
+
+                    break;
+                }
+
+                // A reference whose group is cut off yields to an unknown
+                // command without the group; it is only so if the group is
+                // complete
+                if (!end && *first == '\\' && *pos == '{') {
+                    const char* group = pos;
+
+                    if (!boost::spirit::x3::parse(group, last, gls::group))
+                        break;
+                }
+
+                entry.apply_visitor(streamed);
+                first = pos;
+            }
+
+            if (end && first != last) {
+                report("error: failed to parse the input ", std::quoted(fileName));
+                succeeded = false;
+                break;
+            }
+
+            if (!out.flush()) {
+                report("error: failed to write the output of ", std::quoted(fileName));
+                succeeded = false;
+                break;
+            }
+
+            buffer.erase(0, static_cast<std::size_t>(first - buffer.data()));
+        }
+    }
+    catch (const ExpandDefined<decltype(filter)>::Deferred&) {
+        report("error: an abbreviation is used before its definition or redefined after its use in ",
+            std::quoted(fileName), ", which cannot be streamed");
+        succeeded = false;
+    }
+    catch (const std::runtime_error& error) {
+        report("error: ", error.what(), " in ", std::quoted(fileName));
+        succeeded = false;
+    }
+
+    queue.close();
+    reader.join();
+
+    if (file != stdin)
+        std::fclose(file);
+
+    if (succeeded && readFailed) {
+        report("error: failed to read the input ", std::quoted(fileName));
+        succeeded = false;
+    }
+
+    if (succeeded && !filter.finish()) {
+        report("error: failed to parse the input ", std::quoted(fileName));
+        succeeded = false;
+    }
+
+    if (succeeded && !out.flush()) {
+        report("error: failed to write the output of ", std::quoted(fileName));
+        succeeded = false;
+    }
+
+    e.counters.outputBytes = out.bytes;
+    statistics.add(e.counters);
+
+    return succeeded;
+}
+
+void write_statistics(std::ostream& out, const std::vector<Stage>& stages,
+    std::size_t inputs, std::size_t definitions, const Dictionary& dictionary, std::size_t allocations)
+{
+    const Counters counters = statistics.get();
+
+    out << "{\n  \"stages\": {";
+
+    for (std::size_t i = 0; i != stages.size(); ++i)
+        out << (i == 0 ? "" : ",") << "\n    \"" << stages[i].name << "\": {\"seconds\": "
+            << std::fixed << std::setprecision(6) << stages[i].seconds
+            << ", \"bytes\": " << stages[i].bytes << '}';
+
+    out << "\n  },\n  \"inputs\": " << inputs
+        << ",\n  \"cached_outputs\": " << counters.cached
+        << ",\n  \"text_runs\": " << counters.textRuns
+        << ",\n  \"references\": {";
+
+    const char* separator = "";
+
+    gls::reference_name.for_each(
+        [&] (const auto& name, unsigned flags)
+        {
+            out << separator << '"' << std::string{name.begin(), name.end()} << "\": " << counters.references[flags];
+            separator = ", ";
+        }
+    );
+
+    out << "},\n  \"definitions\": " << definitions
+        << ",\n  \"abbreviations\": " << dictionary.size()
+        << ",\n  \"missing_definitions\": " << counters.missing
+        << ",\n  \"allocations\": " << allocations;
+
+#ifdef HAVE_GETRUSAGE
+    rusage usage{};
+
+    // The maximum resident set size is given in kilobytes
+    if (::getrusage(RUSAGE_SELF, &usage) == 0)
+        out << ",\n  \"peak_memory\": " << static_cast<std::uint64_t>(usage.ru_maxrss) * 1024;
+#endif // HAVE_GETRUSAGE
+
+    out << "\n}";
+}
+
+namespace glsexpand {
+
+struct Glossary::Impl
+{
+    // Copies of the documents the definitions refer to; their addresses
+    // remain stable as documents are added
+    std::deque<std::string> documents;
+    Dictionary dictionary;
+};
+
+Glossary::Glossary()
+    : impl_{std::make_unique<Impl>()}
+{
+}
+
+Glossary::Glossary(Glossary&& other) noexcept = default;
+Glossary::~Glossary() = default;
+
+Glossary& Glossary::operator=(Glossary&& other) noexcept = default;
+
+void Glossary::add(std::string_view document)
+{
+    const std::string& text = impl_->documents.emplace_back(document);
+    CollectDefinitions collect;
+
+    if (!for_each_entry(text.data(), text.data() + text.size(), nullptr, collect)) {
+        impl_->documents.pop_back();
+        throw std::runtime_error("failed to parse the glossary");
+    }
+
+    for (const ast::Abbreviation& definition : collect.definitions)
+        impl_->dictionary.insert(definition);
+
+    impl_->dictionary.finalize();
+}
+
+std::size_t Glossary::size() const noexcept
+{
+    return impl_->dictionary.size();
+}
+
+// Output sink that passes the text on to a function in pieces of up to a
+// given size
+class FunctionSink
+{
+public:
+    FunctionSink(const std::function<void(std::string_view)>& function, std::size_t capacity = 1 << 16)
+        : function_(function)
+        , capacity_(capacity)
+    {
+        buffer_.reserve(capacity);
+    }
+
+    void write(std::string_view value)
+    {
+        if (buffer_.size() + value.size() > capacity_)
+            flush();
+
+        if (value.size() >= capacity_)
+            function_(value);
+        else
+            buffer_.append(value);
+    }
+
+    void put(char c)
+    {
+        if (buffer_.size() == capacity_)
+            flush();
+
+        buffer_.push_back(c);
+    }
+
+    bool flush()
+    {
+        if (!buffer_.empty()) {
+            function_(buffer_);
+            buffer_.clear();
+        }
+
+        return true;
+    }
+
+private:
+    const std::function<void(std::string_view)>& function_;
+    std::size_t capacity_;
+    std::string buffer_;
+};
+
+// Expands the document into the sink using the glossary definitions, if
+// any, see expand() below
+template<class Sink>
+void expand_text(std::string_view document, const Dictionary* glossary, Sink& out)
+{
+    GLSEXPAND_TRACE_SCOPE(expand);
+
+    const char* first = document.data();
+    const char* last = first + document.size();
+
+    CollectDefinitions collect;
+
+    if (!for_each_entry(first, last, nullptr, collect))
+        throw std::runtime_error("failed to parse the document");
+
+    // Use the glossary as is unless the document adds to it
+    std::optional<Dictionary> own;
+    const Dictionary* definitions = glossary;
+
+    if (definitions == nullptr || !collect.definitions.empty()) {
+        own.emplace(definitions != nullptr ? *definitions : Dictionary{});
+
+        for (const ast::Abbreviation& definition : collect.definitions)
+            own->insert(definition);
+
+        own->finalize();
+        definitions = &*own;
+    }
+
+    AdditionFilter filter{out};
+    std::vector<bool> seen;
+    Expand e{filter, *definitions, seen};
+
+    for_each_entry(first, last, definitions, e);
+
+    if (!filter.finish())
+        throw std::runtime_error("failed to parse the document");
+
+    out.flush();
+}
+
+void expand(std::string_view document, const Glossary* glossary,
+    const std::function<void(std::string_view)>& sink)
+{
+    FunctionSink out{sink};
+    expand_text(document, glossary != nullptr ? &glossary->impl_->dictionary : nullptr, out);
+}
+
+std::string expand(std::string_view document, const Glossary* glossary)
+{
+    StringSink out;
+    out.text.reserve(document.size());
+
+    expand_text(document, glossary != nullptr ? &glossary->impl_->dictionary : nullptr, out);
+
+    return std::move(out.text);
+}
+
+} // namespace glsexpand
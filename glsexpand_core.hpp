@@ -0,0 +1,2153 @@
+//
+// Copyright (c) 2019 Sergiu Deitsch <sergiu.deitsch@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation and/or
+// other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+// ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+
+#ifndef GLSEXPAND_CORE_HPP
+#define GLSEXPAND_CORE_HPP
+
+// Internals of glsexpand shared by the tool, libglsexpand and the benchmarks:
+// the grammar, the dictionary, the expansion and its sinks, and the handling
+// of inputs. Built into libglsexpand; not part of its interface.
+// #define BOOST_SPIRIT_X3_DEBUG
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifdef HAVE_WRITEV
+#include <cerrno>
+#include <climits>
+
+#include <sys/uio.h>
+#include <unistd.h>
+#endif // HAVE_WRITEV
+
+#ifdef HAVE_UNISTD_H
+#include <cerrno>
+
+#include <unistd.h>
+#endif // HAVE_UNISTD_H
+
+#ifdef HAVE_GETRUSAGE
+#include <sys/resource.h>
+#endif // HAVE_GETRUSAGE
+
+#ifdef HAVE_INOTIFY
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif // HAVE_INOTIFY
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif // defined(__SSE2__) || defined(_M_X64)
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif // defined(__GNUC__) && defined(__x86_64__)
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif // defined(__ARM_NEON)
+
+#if defined(GLSEXPAND_TRACE_USDT)
+#include <sys/sdt.h>
+#elif defined(GLSEXPAND_TRACE_TRACY)
+#include <tracy/Tracy.hpp>
+#endif // defined(GLSEXPAND_TRACE_USDT)
+
+#include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/spirit/home/x3.hpp>
+#include <boost/spirit/home/x3/support/ast/variant.hpp>
+
+// Tracing hooks, compiled in on request only. GLSEXPAND_TRACE_SCOPE(stage)
+// marks the rest of the enclosing block as the stage: the USDT probes
+// glsexpand:stage_begin and glsexpand:stage_end fire at its ends, or the block
+// becomes a Tracy zone. GLSEXPAND_TRACE_MARK(event) marks a point in time as
+// the probe glsexpand:event or a Tracy message. Otherwise, neither expands to
+// any code.
+#if defined(GLSEXPAND_TRACE_USDT)
+// Calls the function when leaving the scope
+template<class F>
+class TraceScope
+{
+public:
+    explicit TraceScope(F f) noexcept
+        : f_(f)
+    {
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    ~TraceScope()
+    {
+        f_();
+    }
+
+private:
+    F f_;
+};
+
+#define GLSEXPAND_TRACE_SCOPE(stage) \
+    DTRACE_PROBE(glsexpand, stage##_begin); \
+    const TraceScope trace_##stage{[] { DTRACE_PROBE(glsexpand, stage##_end); }}
+#define GLSEXPAND_TRACE_MARK(event) DTRACE_PROBE(glsexpand, event)
+#elif defined(GLSEXPAND_TRACE_TRACY)
+#define GLSEXPAND_TRACE_SCOPE(stage) ZoneScopedN(#stage)
+#define GLSEXPAND_TRACE_MARK(event) TracyMessageL(#event)
+#else
+#define GLSEXPAND_TRACE_SCOPE(stage) static_cast<void>(0)
+#define GLSEXPAND_TRACE_MARK(event) static_cast<void>(0)
+#endif // defined(GLSEXPAND_TRACE_USDT)
+
+namespace ast {
+
+enum Flags
+{
+    None      = 0,
+    Plural    = 1 << 0,
+    Uppercase = 1 << 1,
+    First     = 1 << 2
+};
+
+constexpr int ModifiersMask = Plural | Uppercase;
+
+// The AST does not own any text: all strings are views into the input buffer
+// which must therefore outlive the parsed entries.
+
+// Abbreviation definition
+struct Abbreviation
+{
+    std::string_view name;
+    std::string_view shortName;
+    std::string_view value;
+};
+
+// Index of a reference whose definition is not known yet
+constexpr std::size_t Unresolved = static_cast<std::size_t>(-1);
+
+// Reference to an abbreviation
+struct Reference
+{
+    std::string_view name;
+    unsigned flags;
+    // Index of the definition if it was known at parse time
+    std::size_t id = Unresolved;
+};
+
+using Entry = boost::spirit::x3::variant
+<
+      std::string_view
+    , Reference
+    , Abbreviation
+>;
+
+} // namespace ast
+
+// Abbreviation definitions indexed by name. Definitions are stored densely in
+// the order of their first definition and are looked up through a flat, open
+// addressing hash table with linear probing. A redefinition replaces the
+// previous definition but keeps its index.
+//
+// Once all definitions are known, finalize() renders every abbreviation in
+// all variants so that expanding a reference amounts to copying a string.
+// Adding definitions afterwards only requires rendering the new ones, while a
+// redefinition requires rendering all of them again.
+//
+// Definitions may refer to other abbreviations, as in "\gls{gpu} accelerated
+// \gls{cnn}". Their variants are rendered into segments of text and nested
+// references instead, which are parsed only once; whether a nested reference
+// is a first use is only known when the variant is expanded.
+class Dictionary
+{
+public:
+    static constexpr std::size_t npos = ast::Unresolved;
+    // First and subsequent use for each modifier combination
+    static constexpr std::size_t Variants = 2 * (ast::ModifiersMask + 1);
+
+    // Slot table and rendered expansions of definitions that do not refer to
+    // other abbreviations, as stored in a compiled glossary. The offsets of
+    // the Variants of each definition are followed by the end offset.
+    struct Tables
+    {
+        const std::uint32_t* slots = nullptr;
+        std::size_t slotCount = 0;
+        const std::size_t* offsets = nullptr;
+        std::string_view expansions;
+    };
+
+    void insert(const ast::Abbreviation& value)
+    {
+        std::size_t slot = probe(value.name);
+
+        if (slots_.empty() || slots_[slot] == 0) {
+            if (2 * (entries_.size() + 1) > slots_.size()) {
+                rehash(std::max<std::size_t>(16, 2 * slots_.size()));
+                slot = probe(value.name);
+            }
+
+            entries_.push_back(value);
+            slots_[slot] = static_cast<std::uint32_t>(entries_.size());
+        }
+        else {
+            // Render everything again, including the adopted definitions if
+            // one of them changes
+            if (slots_[slot] <= adopted_) {
+                adopted_ = 0;
+                adoptedExpansions_ = {};
+            }
+
+            entries_[slots_[slot] - 1] = value;
+            expansions_.clear();
+            offsets_.clear();
+            segments_.clear();
+            segmentOffsets_.clear();
+        }
+    }
+
+    // Returns the index of the definition or npos if there is none
+    std::size_t find(std::string_view name) const noexcept
+    {
+        if (slots_.empty())
+            return npos;
+
+        const std::uint32_t index = slots_[probe(name)];
+        return index == 0 ? npos : index - 1;
+    }
+
+    const ast::Abbreviation& operator[](std::size_t index) const noexcept
+    {
+        return entries_[index];
+    }
+
+    // Part of a variant referring to other abbreviations: either a range of
+    // the rendered text or a nested reference, if the name is not empty
+    struct Segment
+    {
+        std::size_t offset;
+        std::size_t size;
+        std::string_view name;
+        unsigned flags;
+    };
+
+    // Renders the expansions of all definitions not rendered yet
+    void finalize();
+
+    // Takes over the definitions of a compiled glossary along with their
+    // tables, which replaces inserting and rendering them. The expansions are
+    // used in place; definitions inserted later are rendered separately. The
+    // glossary must outlive the dictionary. Requires an empty dictionary.
+    void adopt(const std::vector<ast::Abbreviation>& definitions, const Tables& tables);
+
+    // Returns the slot table, which a compiled glossary stores
+    const std::vector<std::uint32_t>& slots() const noexcept
+    {
+        return slots_;
+    }
+
+    // Returns the size of the rendered expansions
+    std::size_t rendered() const noexcept
+    {
+        return adoptedExpansions_.size() + expansions_.size();
+    }
+
+    bool finalized() const noexcept
+    {
+        return offsets_.size() == Variants * (entries_.size() - adopted_) + 1;
+    }
+
+    // Returns the expansion of the definition for the modifier flags,
+    // requires finalize() to have been called after the last insertion and
+    // the variant not to have segments
+    std::string_view expansion(std::size_t index, unsigned flags, bool used) const noexcept
+    {
+        if (index < adopted_) {
+            const std::size_t v = variant(index, flags, used);
+            return adoptedExpansions_.substr(adoptedOffsets_[v], adoptedOffsets_[v + 1] - adoptedOffsets_[v]);
+        }
+
+        const std::size_t v = variant(index - adopted_, flags, used);
+        return std::string_view(expansions_.data() + offsets_[v], offsets_[v + 1] - offsets_[v]);
+    }
+
+    // Returns the segments of the variant, which are empty unless the
+    // definition refers to other abbreviations
+    std::pair<const Segment*, const Segment*> segments(std::size_t index, unsigned flags, bool used) const noexcept
+    {
+        // None of the adopted definitions has segments
+        if (index < adopted_ || segments_.empty())
+            return {nullptr, nullptr};
+
+        const std::size_t v = variant(index - adopted_, flags, used);
+        return {segments_.data() + segmentOffsets_[v], segments_.data() + segmentOffsets_[v + 1]};
+    }
+
+    std::string_view text(const Segment& segment) const noexcept
+    {
+        return std::string_view(expansions_.data() + segment.offset, segment.size);
+    }
+
+    // Returns whether any definition refers to other abbreviations
+    bool nested() const noexcept
+    {
+        return !segments_.empty();
+    }
+
+    std::size_t size() const noexcept
+    {
+        return entries_.size();
+    }
+
+private:
+    static std::size_t variant(std::size_t index, unsigned flags, bool used) noexcept
+    {
+        return Variants * index + 2 * (flags & ast::ModifiersMask) + used;
+    }
+
+    // Renders the variants of a definition that refers to other
+    // abbreviations into segments
+    void renderSegments(const ast::Abbreviation& abbreviation);
+
+    // Returns the slot holding name or the empty slot where it belongs
+    std::size_t probe(std::string_view name) const noexcept
+    {
+        if (slots_.empty())
+            return 0;
+
+        const std::size_t mask = slots_.size() - 1;
+        std::size_t slot = std::hash<std::string_view>{}(name) & mask;
+
+        while (slots_[slot] != 0 && entries_[slots_[slot] - 1].name != name)
+            slot = (slot + 1) & mask;
+
+        return slot;
+    }
+
+    void rehash(std::size_t capacity)
+    {
+        slots_.assign(capacity, 0);
+
+        for (std::size_t i = 0; i != entries_.size(); ++i)
+            slots_[probe(entries_[i].name)] = static_cast<std::uint32_t>(i + 1);
+    }
+
+    std::vector<ast::Abbreviation> entries_;
+    // One-based indices into entries_, 0 marks an empty slot
+    std::vector<std::uint32_t> slots_;
+    // Rendered expansions and the offsets of each variant therein, for the
+    // definitions following the adopted ones
+    std::string expansions_;
+    std::vector<std::size_t> offsets_;
+    // Segments of the variants referring to other abbreviations and the
+    // offsets of each variant therein
+    std::vector<Segment> segments_;
+    std::vector<std::size_t> segmentOffsets_;
+    // Number of leading definitions rendered in the tables of a compiled
+    // glossary; only the slot table is copied as insertions modify it
+    std::size_t adopted_ = 0;
+    const std::size_t* adoptedOffsets_ = nullptr;
+    std::string_view adoptedExpansions_;
+};
+
+// Locating braces 16 or 32 bytes at a time. Groups are delimited by the
+// matching brace only, so everything in between can be skipped in bulk.
+namespace braces {
+
+// Returns the first brace in [first, last), or last
+const char* find(const char* first, const char* last) noexcept;
+
+// Returns the brace matching the opening brace preceding first, or nullptr if
+// the group is not closed. Nested groups must not be empty, which makes the
+// group invalid as well.
+const char* match(const char* first, const char* last) noexcept;
+
+} // namespace braces
+
+// Locating line breaks 16 or 32 bytes at a time to map offsets to lines. The
+// index is only needed for diagnostics and thus built on demand.
+namespace newlines {
+
+// Returns the offsets of all line breaks in [first, last) in ascending order
+std::vector<std::size_t> index(const char* first, const char* last);
+
+} // namespace newlines
+
+namespace gls {
+    using namespace boost::spirit::x3;
+
+    // Matches a group of balanced braces and yields its content, including
+    // the braces of nested groups, which may be mixed with text as in
+    // "{group1 {group2} text}". The content is contiguous in the input and is
+    // referenced directly.
+    struct group_parser
+        : parser<group_parser>
+    {
+        using attribute_type = std::string_view;
+
+        template<class Context, class RContext, class Attribute>
+        bool parse(const char*& first, const char* last, const Context&, RContext&, Attribute& attr) const
+        {
+            if (first == last || *first != '{')
+                return false;
+
+            const char* end = braces::match(first + 1, last);
+
+            if (end == nullptr)
+                return false;
+
+            if constexpr (!std::is_same_v<Attribute, unused_type>)
+                attr = std::string_view(first + 1, static_cast<std::size_t>(end - first - 1));
+
+            first = end + 1;
+            return true;
+        }
+    };
+
+    const rule<struct group, std::string_view> group = "group";
+
+    const auto group_def = group_parser{};
+
+    BOOST_SPIRIT_DEFINE(group);
+
+    // Tag of the dictionary that references are resolved against at parse time
+    struct dictionary_tag {};
+
+    // Interns the name of the reference being parsed if with<dictionary_tag>
+    // provides definitions. References to names that are not defined (yet) are
+    // left unresolved and bound late during the expansion.
+    const auto resolve =
+        [] (auto& ctx)
+        {
+            if (const Dictionary* definitions = get<dictionary_tag>(ctx))
+                _val(ctx).id = definitions->find(_val(ctx).name);
+        };
+
+    const auto newacronym_def =
+           "\\newacronym"
+        >> group
+        [
+            (
+                [] (auto& ctx)
+                {
+                    _val(ctx).name = _attr(ctx);
+                }
+            )
+        ]
+        >> group
+        [
+            (
+                [] (auto& ctx)
+                {
+                    _val(ctx).shortName = _attr(ctx);
+                }
+            )
+        ]
+        >> group
+        [
+            (
+                [] (auto& ctx)
+                {
+                    _val(ctx).value = _attr(ctx);
+                }
+            )
+        ]
+        ;
+
+    // Reference commands by their name following the backslash, along with
+    // the modifier flags they imply. The names are looked up in a ternary
+    // search tree which finds the longest name in a single scan. A shorter
+    // name can never apply instead since a group must follow the name
+    // immediately and names consist of letters only.
+    struct reference_names
+        : symbols<unsigned>
+    {
+        reference_names()
+        {
+            add
+                ("gls", ast::None)
+                ("glspl", ast::Plural)
+                ("Gls", ast::Uppercase)
+                ("Glspl", ast::Uppercase | ast::Plural)
+                ("Glsfirst", ast::Uppercase | ast::First)
+                ;
+        }
+    };
+
+    const reference_names reference_name;
+
+    // Parse \gls, \glspl, \Gls, \Glspl and \Glsfirst
+    const auto reference_def =
+           '\\'
+        >> reference_name
+        [
+            (
+                [] (auto& ctx)
+                {
+                    _val(ctx).flags = _attr(ctx);
+                }
+            )
+        ]
+        >> group
+        [
+            (
+                [] (auto& ctx)
+                {
+                    _val(ctx).name = _attr(ctx);
+                    resolve(ctx);
+                }
+            )
+        ]
+        ;
+
+    const auto gls_other =
+           lit("\\gls") >> +alpha
+           ;
+
+    const rule<struct newacronym, ast::Abbreviation> newacronym = "newacronym";
+    const rule<struct reference, ast::Reference> reference = "reference";
+
+    BOOST_SPIRIT_DEFINE(newacronym);
+    BOOST_SPIRIT_DEFINE(reference);
+
+    const auto gls_commands =
+          newacronym
+        | reference
+        ;
+
+    // Matches a run of plain text, i.e., everything up to the next \newacronym,
+    // reference command or other \gls... command. Only a backslash can start a
+    // command, so the run is scanned with memchr and the command names are
+    // looked up at backslashes only.
+    struct plain_parser
+        : parser<plain_parser>
+    {
+        using attribute_type = std::string_view;
+
+        static bool starts_command(const char* pos, const char* last) noexcept
+        {
+            const std::string_view tail(pos, static_cast<std::size_t>(last - pos));
+
+            if (tail.compare(0, 11, "\\newacronym") == 0 || tail.compare(0, 4, "\\gls") == 0)
+                return true;
+
+            // Any of the reference names, which the reference rule tries
+            const char* name = pos + 1;
+            return reference_name.prefix_find(name, last) != nullptr;
+        }
+
+        // Returns the start of the first command at or after pos, or last
+        static const char* find_command(const char* pos, const char* last) noexcept
+        {
+            while (pos != last) {
+                pos = static_cast<const char*>(std::memchr(pos, '\\', static_cast<std::size_t>(last - pos)));
+
+                if (pos == nullptr)
+                    return last;
+
+                if (starts_command(pos, last))
+                    break;
+
+                ++pos;
+            }
+
+            return pos;
+        }
+
+        template<class Context, class RContext, class Attribute>
+        bool parse(const char*& first, const char* last, const Context&, RContext&, Attribute& attr) const
+        {
+            const char* pos = find_command(first, last);
+
+            if (pos == first)
+                return false;
+
+            if constexpr (!std::is_same_v<Attribute, unused_type>)
+                attr = std::string_view(first, static_cast<std::size_t>(pos - first));
+
+            first = pos;
+            return true;
+        }
+    };
+
+    const rule<struct plain, std::string_view> plain = "plain";
+
+    const auto plain_def = plain_parser{};
+
+    BOOST_SPIRIT_DEFINE(plain);
+
+    // A single document entry; unknown \gls... commands yield an empty text run
+    const auto gls_token =
+          gls_commands
+        | omit[gls_other]
+        | plain
+        ;
+
+    const auto gls_tokens = *gls_token >> eoi;
+
+} // namespace gls
+
+// Collects the pieces of the expansion of a reference to the definition at
+// index, which refers to other abbreviations, and marks the definitions
+// expanded as used. Throws std::runtime_error for a nested reference without
+// a definition or if definitions refer to each other; seen is left unchanged
+// then.
+void collect_expansion(const Dictionary& definitions, std::size_t index, unsigned flags,
+    std::vector<bool>& seen, std::vector<std::string_view>& pieces);
+
+// Writes the expansion of a reference to the definition at index and marks
+// the definition as used. References in the definition are expanded in turn
+// and become used as well. Throws std::runtime_error as collect_expansion()
+// does, before anything is written.
+template<class Sink>
+void write_expansion(Sink& out, const Dictionary& definitions, std::size_t index, unsigned flags,
+    std::vector<bool>& seen)
+{
+    const bool used = seen[index] & ((flags & ast::First) == 0);
+    const auto [first, last] = definitions.segments(index, flags, used);
+
+    if (first == last) {
+        out.write(definitions.expansion(index, flags, used));
+        seen[index] = true;
+        return;
+    }
+
+    std::vector<std::string_view> pieces;
+    collect_expansion(definitions, index, flags, seen, pieces);
+
+    for (std::string_view piece : pieces)
+        out.write(piece);
+}
+
+// What the expansion of a document encountered, reported by --stats
+struct Counters
+{
+    Counters& operator+=(const Counters& other) noexcept
+    {
+        textRuns += other.textRuns;
+
+        for (std::size_t i = 0; i != references.size(); ++i)
+            references[i] += other.references[i];
+
+        missing += other.missing;
+        cached += other.cached;
+        outputBytes += other.outputBytes;
+
+        return *this;
+    }
+
+    std::size_t textRuns = 0;
+    // References by their flags, and thus by command
+    std::array<std::size_t, ast::First << 1> references{};
+    // References without a definition
+    std::size_t missing = 0;
+    // Documents whose output was reused
+    std::size_t cached = 0;
+    std::size_t outputBytes = 0;
+};
+
+// Totals over all documents
+struct Statistics
+{
+    void add(const Counters& counters)
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        totals += counters;
+    }
+
+    Counters get()
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        return totals;
+    }
+
+    // Starts over, e.g., with the next round of the watch mode
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        totals = Counters{};
+    }
+
+    std::mutex mutex;
+    Counters totals;
+};
+
+// Totals of the current run
+extern Statistics statistics;
+
+// Writes the formatted diagnostic to the standard error at once, serialized
+// with all other diagnostics so that the messages of inputs processed
+// concurrently do not interleave
+void write_report(const std::string& message);
+
+// Writes a diagnostic line made of the arguments
+template<class... Args>
+void report(const Args&... args)
+{
+    std::ostringstream message;
+    (message << ... << args) << '\n';
+
+    write_report(message.str());
+}
+
+// Most problems kept for a single document
+constexpr std::size_t MaxDiagnostics = 100;
+
+// Problems found in a document along with their position. Only the first
+// MaxDiagnostics are kept and the rest are merely counted, so that a document
+// full of errors cannot exhaust the memory. Positions are mapped to lines and
+// columns only once the problems are reported.
+class Diagnostics
+{
+public:
+    Diagnostics(const char* first, const char* last, bool recover) noexcept
+        : first_(first)
+        , last_(last)
+        , recover_(recover)
+    {
+    }
+
+    // Whether to continue after a problem instead of giving up
+    bool recovering() const noexcept
+    {
+        return recover_;
+    }
+
+    bool empty() const noexcept
+    {
+        return count_ == 0;
+    }
+
+    std::size_t size() const noexcept
+    {
+        return count_;
+    }
+
+    // Records a problem at the position in the document
+    void add(const char* position, std::string message)
+    {
+        if (count_++ < MaxDiagnostics)
+            diagnostics_.push_back(Diagnostic{position, std::move(message)});
+    }
+
+    // Reports the problems in the order of their position as
+    // "file:line:column: error: message", where the column counts bytes
+    void report(const std::string& fileName) const
+    {
+        std::vector<Diagnostic> diagnostics = diagnostics_;
+
+        std::stable_sort(diagnostics.begin(), diagnostics.end(),
+            [] (const Diagnostic& a, const Diagnostic& b)
+            {
+                return a.position < b.position;
+            }
+        );
+
+        const std::vector<std::size_t> lines = newlines::index(first_, last_);
+
+        for (const Diagnostic& d : diagnostics) {
+            if (d.position < first_ || d.position > last_) {
+                ::report(fileName, ": error: ", d.message);
+                continue;
+            }
+
+            const auto offset = static_cast<std::size_t>(d.position - first_);
+            const auto line = static_cast<std::size_t>(std::lower_bound(lines.begin(), lines.end(), offset) - lines.begin());
+            const std::size_t start = line == 0 ? 0 : lines[line - 1] + 1;
+
+            ::report(fileName, ':', line + 1, ':', offset - start + 1, ": error: ", d.message);
+        }
+
+        if (count_ > MaxDiagnostics)
+            ::report(fileName, ": error: ", count_ - MaxDiagnostics, " more errors not shown");
+    }
+
+private:
+    struct Diagnostic
+    {
+        const char* position;
+        std::string message;
+    };
+
+    const char* first_;
+    const char* last_;
+    bool recover_;
+    std::vector<Diagnostic> diagnostics_;
+    std::size_t count_ = 0;
+};
+
+// Writes the expanded document to a sink providing write(std::string_view)
+template<class Sink>
+struct Expand
+{
+    using result_type = void;
+
+    Expand(Sink& out, const Dictionary& definitions, std::vector<bool>& seen)
+        : out(out)
+        , definitions(definitions)
+        , seen(seen)
+    {
+        seen.resize(definitions.size());
+    }
+
+    void operator()(std::string_view value)
+    {
+        ++counters.textRuns;
+        out.write(value);
+    }
+
+    void operator()(const ast::Reference& value)
+    {
+        ++counters.references[value.flags];
+
+        const std::size_t index =
+            value.id != ast::Unresolved ? value.id : definitions.find(value.name);
+
+        if (index == Dictionary::npos) {
+            fail(value, "missing definition for " + std::string{value.name});
+            return;
+        }
+
+        try {
+            write_expansion(out, definitions, index, value.flags, seen);
+        }
+        catch (const std::runtime_error& error) {
+            fail(value, error.what());
+        }
+    }
+
+    void operator()(const ast::Abbreviation& value) const
+    {
+    }
+
+    // Records the problem with the reference if diagnostics are collected.
+    // Throws std::runtime_error unless recovering, in which case the
+    // reference is written as it appears in the document.
+    void fail(const ast::Reference& value, const std::string& message)
+    {
+        // The command name precedes the group holding the name
+        const char* command = value.name.data() - 1;
+
+        while (*--command != '\\')
+            ;
+
+        if (diagnostics != nullptr)
+            diagnostics->add(command, message);
+
+        if (diagnostics == nullptr || !diagnostics->recovering())
+            throw std::runtime_error(message);
+
+        ++counters.missing;
+
+        out.write(std::string_view(command, static_cast<std::size_t>(value.name.data() + value.name.size() + 1 - command)));
+    }
+
+    Sink& out;
+    const Dictionary& definitions;
+    // Whether each definition has been used already
+    std::vector<bool>& seen;
+    Counters counters;
+    // Problems found in the document; references are parsed from it then
+    Diagnostics* diagnostics = nullptr;
+};
+
+// Expands a document that defines its abbreviations before using them while
+// adding the definitions to the dictionary. Throws Deferred as soon as a
+// reference precedes its definition, or an abbreviation used already is
+// redefined: the later definition determines the expansion of all uses.
+template<class Sink>
+struct ExpandDefined
+{
+    using result_type = void;
+
+    struct Deferred {};
+
+    ExpandDefined(Sink& out, Dictionary& definitions, std::vector<bool>& seen)
+        : out(out)
+        , definitions(definitions)
+        , seen(seen)
+    {
+    }
+
+    void operator()(std::string_view value)
+    {
+        ++counters.textRuns;
+        out.write(value);
+    }
+
+    void operator()(const ast::Reference& value)
+    {
+        ++counters.references[value.flags];
+
+        const std::size_t index = definitions.find(value.name);
+
+        if (index == Dictionary::npos)
+            throw Deferred{};
+
+        if (!definitions.finalized())
+            definitions.finalize();
+
+        seen.resize(definitions.size());
+
+        write_expansion(out, definitions, index, value.flags, seen);
+    }
+
+    void operator()(const ast::Abbreviation& value)
+    {
+        const std::size_t index = definitions.find(value.name);
+
+        if (index != Dictionary::npos && index < seen.size() && seen[index])
+            throw Deferred{};
+
+        definitions.insert(value);
+        collected.push_back(value);
+    }
+
+    Sink& out;
+    Dictionary& definitions;
+    std::vector<bool>& seen;
+    // The definitions of the document in their order
+    std::vector<ast::Abbreviation> collected;
+    Counters counters;
+};
+
+struct BuildDictionary
+{
+    using result_type = void;
+
+    void operator()(std::string_view value) const
+    {
+    }
+
+    void operator()(const ast::Reference& value) const
+    {
+        //std::cout << value.name << std::endl;
+    }
+
+    void operator()(const ast::Abbreviation& value)
+    {
+        //std::cout << value.name << std::endl;
+        dict.insert(value);
+        check(value);
+    }
+
+    // Warns about a definition that is inserted into the dictionary in
+    // another way
+    static void check(const ast::Abbreviation& value)
+    {
+        if (value.value.empty())
+            report("warning: description of ", value.name, " is empty");
+    }
+
+    Dictionary dict;
+};
+
+// Collects the definitions of a document in their order
+struct CollectDefinitions
+{
+    using result_type = void;
+
+    void operator()(std::string_view value) const
+    {
+    }
+
+    void operator()(const ast::Reference& value) const
+    {
+    }
+
+    void operator()(const ast::Abbreviation& value)
+    {
+        definitions.push_back(value);
+    }
+
+    std::vector<ast::Abbreviation> definitions;
+};
+
+// Output sink that collects the written text in a buffer and hands it to the
+// file in large blocks. Text at least as large as the buffer is written
+// directly.
+class OutputBuffer
+{
+public:
+    explicit OutputBuffer(std::FILE* file, std::size_t capacity = 1 << 16)
+        : file_(file)
+    {
+        buffer_.reserve(capacity);
+    }
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    ~OutputBuffer()
+    {
+        flush();
+    }
+
+    void write(std::string_view value)
+    {
+        if (buffer_.size() + value.size() > buffer_.capacity()) {
+            flush();
+
+            if (value.size() >= buffer_.capacity()) {
+                store(value.data(), value.size());
+                return;
+            }
+        }
+
+        buffer_.insert(buffer_.end(), value.begin(), value.end());
+    }
+
+    void put(char c)
+    {
+        if (buffer_.size() == buffer_.capacity())
+            flush();
+
+        buffer_.push_back(c);
+    }
+
+    // Writes out the buffered text. Returns false if any write has failed.
+    bool flush()
+    {
+        store(buffer_.data(), buffer_.size());
+        buffer_.clear();
+
+        if (std::fflush(file_) != 0)
+            failed_ = true;
+
+        return !failed_;
+    }
+
+private:
+    void store(const char* data, std::size_t size)
+    {
+        if (size > 0 && std::fwrite(data, 1, size, file_) != size)
+            failed_ = true;
+    }
+
+    std::FILE* file_;
+    std::vector<char> buffer_;
+    bool failed_ = false;
+};
+
+#ifdef HAVE_WRITEV
+// Output sink that does not copy the text but collects the written views as
+// segments and hands them to writev(2) in batches. Text written as a view has
+// to stay valid until the next flush(), which holds for the input buffer and
+// the rendered expansions. Short pieces, which would not be worth a segment of
+// their own, are copied into a fixed staging buffer instead.
+class GatherWriter
+{
+public:
+    explicit GatherWriter(int fd, std::size_t capacity = 1 << 16)
+        : fd_(fd)
+    {
+        staging_.reserve(capacity);
+        segments_.reserve(MaxSegments);
+    }
+
+    GatherWriter(const GatherWriter&) = delete;
+    GatherWriter& operator=(const GatherWriter&) = delete;
+
+    ~GatherWriter()
+    {
+        flush();
+    }
+
+    void write(std::string_view value)
+    {
+        if (value.size() < CopyThreshold)
+            copy(value.data(), value.size());
+        else
+            append(value.data(), value.size());
+    }
+
+    void put(char c)
+    {
+        copy(&c, 1);
+    }
+
+    // Writes out all pending segments. Returns false if any write has failed.
+    bool flush()
+    {
+        std::size_t first = 0;
+
+        while (first != segments_.size() && !failed_) {
+            const std::size_t count = std::min<std::size_t>(segments_.size() - first, MaxSegments);
+            const ssize_t n = ::writev(fd_, &segments_[first], static_cast<int>(count));
+
+            if (n < 0) {
+                if (errno != EINTR)
+                    failed_ = true;
+
+                continue;
+            }
+
+            // Skip the segments written completely and trim a partial one
+            auto written = static_cast<std::size_t>(n);
+
+            while (first != segments_.size() && written >= segments_[first].iov_len)
+                written -= segments_[first++].iov_len;
+
+            if (written > 0) {
+                segments_[first].iov_base = static_cast<char*>(segments_[first].iov_base) + written;
+                segments_[first].iov_len -= written;
+            }
+        }
+
+        segments_.clear();
+        staging_.clear();
+
+        return !failed_;
+    }
+
+private:
+#ifdef IOV_MAX
+    static constexpr std::size_t MaxSegments = IOV_MAX;
+#else
+    static constexpr std::size_t MaxSegments = 16;
+#endif
+    static constexpr std::size_t CopyThreshold = 64;
+
+    void append(const char* data, std::size_t size)
+    {
+        if (size == 0)
+            return;
+
+        if (!segments_.empty()) {
+            iovec& last = segments_.back();
+
+            if (static_cast<const char*>(last.iov_base) + last.iov_len == data) {
+                last.iov_len += size;
+                return;
+            }
+        }
+
+        if (segments_.size() == 4 * MaxSegments)
+            flush();
+
+        segments_.push_back(iovec{const_cast<char*>(data), size});
+    }
+
+    void copy(const char* data, std::size_t size)
+    {
+        // The staging buffer must never reallocate while segments point into
+        // it, and append() must not flush it between staging and adding the
+        // segment, so make room for both first
+        if (staging_.size() + size > staging_.capacity() || segments_.size() == 4 * MaxSegments)
+            flush();
+
+        const char* pos = staging_.data() + staging_.size();
+        staging_.insert(staging_.end(), data, data + size);
+
+        append(pos, size);
+    }
+
+    int fd_;
+    std::vector<iovec> segments_;
+    std::vector<char> staging_;
+    bool failed_ = false;
+};
+#endif // HAVE_WRITEV
+
+// Output sink that keeps the text in memory
+struct StringSink
+{
+    void write(std::string_view value)
+    {
+        text.append(value);
+    }
+
+    void put(char c)
+    {
+        text.push_back(c);
+    }
+
+    bool flush() const noexcept
+    {
+        return true;
+    }
+
+    std::string text;
+};
+
+// Output sink that passes the text on to another sink and keeps a copy of it
+template<class Sink>
+struct TeeSink
+{
+    void write(std::string_view value)
+    {
+        sink.write(value);
+        copy.append(value);
+    }
+
+    void put(char c)
+    {
+        sink.put(c);
+        copy.push_back(c);
+    }
+
+    bool flush()
+    {
+        return sink.flush();
+    }
+
+    Sink& sink;
+    std::string copy;
+};
+
+// Output sink that passes the text on to another sink and counts its bytes
+template<class Sink>
+struct CountingSink
+{
+    void write(std::string_view value)
+    {
+        sink.write(value);
+        bytes += value.size();
+    }
+
+    void put(char c)
+    {
+        sink.put(c);
+        ++bytes;
+    }
+
+    bool flush()
+    {
+        return sink.flush();
+    }
+
+    Sink& sink;
+    std::size_t bytes = 0;
+};
+
+// Resolves \addition[options]{text} to text on the fly while the expanded
+// document is written to the sink. The filter accepts exactly what
+// \addition[...]{...} used to be parsed with: the options may contain anything
+// but ']', and the group has to be balanced with non-empty nested groups. Any
+// other use of \addition is an error.
+template<class Sink>
+class AdditionFilter
+{
+public:
+    explicit AdditionFilter(Sink& sink)
+        : sink_(sink)
+    {
+    }
+
+    void write(std::string_view value)
+    {
+        filter(value.data(), value.data() + value.size());
+    }
+
+    void put(char c)
+    {
+        filter(&c, &c + 1);
+    }
+
+    // Flushes any pending input. Returns false if the expanded document
+    // contained a malformed or an unterminated \addition.
+    bool finish()
+    {
+        if (state_ == State::Command)
+            flushCommand();
+        else if (state_ != State::Text)
+            failed_ = true;
+
+        state_ = State::Text;
+
+        return !failed_;
+    }
+
+private:
+    enum class State
+    {
+        Text,           // plain text, passed through
+        Command,        // matching the "\addition" prefix
+        Options,        // expecting '['
+        InOptions,      // skipping the options until ']'
+        Group,          // expecting '{'
+        InGroup         // passing the group content through
+    };
+
+    static constexpr std::string_view command{"\\addition"};
+
+    void flushCommand()
+    {
+        sink_.write(command.substr(0, matched_));
+        matched_ = 0;
+    }
+
+    void filter(const char* first, const char* last)
+    {
+        while (first != last && !failed_) {
+            switch (state_) {
+                case State::Text: {
+                    auto pos = static_cast<const char*>(std::memchr(first, '\\', last - first));
+
+                    if (pos == nullptr)
+                        pos = last;
+
+                    sink_.write(std::string_view(first, static_cast<std::size_t>(pos - first)));
+                    first = pos;
+
+                    if (first != last) {
+                        state_ = State::Command;
+                        matched_ = 1;
+                        ++first;
+                    }
+                    break;
+                }
+                case State::Command:
+                    if (*first == command[matched_]) {
+                        ++first;
+
+                        if (++matched_ == command.size()) {
+                            GLSEXPAND_TRACE_MARK(addition);
+                            matched_ = 0;
+                            state_ = State::Options;
+                        }
+                    }
+                    else {
+                        // Not an \addition: emit the partial match and
+                        // rescan the current character as text
+                        flushCommand();
+                        state_ = State::Text;
+                    }
+                    break;
+                case State::Options:
+                    if (*first++ == '[')
+                        state_ = State::InOptions;
+                    else
+                        failed_ = true;
+                    break;
+                case State::InOptions:
+                    if (*first++ == ']')
+                        state_ = State::Group;
+                    break;
+                case State::Group:
+                    if (*first++ == '{') {
+                        state_ = State::InGroup;
+                        depth_ = 1;
+                        opened_ = false;
+                    }
+                    else
+                        failed_ = true;
+                    break;
+                case State::InGroup: {
+                    // Pass the text up to the next brace through at once
+                    const char* pos = braces::find(first, last);
+
+                    if (pos != first) {
+                        sink_.write(std::string_view(first, static_cast<std::size_t>(pos - first)));
+                        opened_ = false;
+                        first = pos;
+                        break;
+                    }
+
+                    const char c = *first++;
+
+                    if (c == '{') {
+                        ++depth_;
+                        opened_ = true;
+                    }
+                    else if (c == '}') {
+                        // Nested groups cannot be empty
+                        if (opened_) {
+                            failed_ = true;
+                            break;
+                        }
+
+                        if (--depth_ == 0) {
+                            state_ = State::Text;
+                            break;
+                        }
+                    }
+                    else
+                        opened_ = false;
+
+                    sink_.put(c);
+                    break;
+                }
+            }
+        }
+    }
+
+    Sink& sink_;
+    State state_ = State::Text;
+    std::size_t matched_ = 0;
+    std::size_t depth_ = 0;
+    bool opened_ = false;
+    bool failed_ = false;
+};
+
+// Parses the document one entry at a time and hands each entry to the visitor
+// right away so that the document is never materialized as a whole. Returns
+// false if the input could not be parsed completely.
+//
+// If definitions are given, references to names already defined there are
+// resolved to their index while parsing. If diagnostics are given, the
+// position where the parse failed is recorded. When recovering, the parse
+// resumes at the next backslash or line, and the input skipped is passed to
+// the visitor as text.
+template<class Visitor>
+bool for_each_entry(const char* first, const char* last, const Dictionary* definitions, Visitor& visitor,
+    Diagnostics* diagnostics = nullptr)
+{
+    using boost::spirit::x3::with;
+
+    const auto parser = with<gls::dictionary_tag>(definitions)[gls::gls_token];
+
+    while (first != last) {
+        ast::Entry entry;
+        const char* start = first;
+
+        if (!boost::spirit::x3::parse(first, last, parser, entry)) {
+            if (diagnostics != nullptr)
+                diagnostics->add(start, "failed to parse the input");
+
+            if (diagnostics == nullptr || !diagnostics->recovering())
+                return false;
+
+            first = std::find_if(start + 1, last, [] (char c) { return c == '\\' || c == '\n'; });
+            entry = std::string_view(start, static_cast<std::size_t>(first - start));
+        }
+
+        entry.apply_visitor(visitor);
+    }
+
+    return true;
+}
+
+// Calls f(i) for each i in [0, count) on up to jobs threads. Threads pick the
+// next pending index as soon as they are done with the previous one, which
+// balances inputs of different size.
+template<class F>
+void parallel_for(std::size_t count, unsigned jobs, F f)
+{
+    std::atomic<std::size_t> next{0};
+
+    const auto work =
+        [&next, count, &f]
+        {
+            for (std::size_t i; (i = next++) < count; )
+                f(i);
+        };
+
+    std::vector<std::thread> threads;
+
+    for (std::size_t i = 1; i < std::min<std::size_t>(jobs, count); ++i)
+        threads.emplace_back(work);
+
+    work();
+
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+// Parses entries starting at pos until the parse reaches boundary. The last
+// entry may extend past boundary; pos is left after it. Returns false if the
+// entries could not be parsed.
+bool parse_entries(const char*& pos, const char* boundary, const char* last, std::vector<ast::Entry>& entries);
+
+// Smallest part of a document worth parsing on a thread of its own
+constexpr std::size_t MinChunkSize = 1 << 18;
+
+// Parses the whole document into entries using up to jobs threads.
+//
+// The document is split into chunks of roughly equal size, each starting at a
+// command. Chunks are parsed speculatively in parallel. A chunk is valid if
+// the (valid) previous chunk ended exactly at its start: the parse from there
+// on is then the same as the sequential one. Otherwise the chunk started
+// inside a command, e.g., a \gls in a \newacronym description, and the part
+// that is not covered yet is parsed again from where the previous chunk ended.
+// Returns false if the document could not be parsed.
+bool parse_entries(const char* first, const char* last, unsigned jobs, std::vector<ast::Entry>& entries);
+
+// Parallel counterpart of Expand for documents whose entries are available as
+// a whole. The first use of an abbreviation is the only order dependent part
+// of the expansion: references are first resolved to definitions in parallel,
+// then a sequential pass over the indices alone determines which references
+// are first uses. Finally, the size of each slice of the entries is computed
+// and the slices are rendered in parallel into their own ranges of output.
+// Returns the index of the first reference without a definition, leaving
+// seen and the output as they were, or the number of entries once all are
+// expanded. Definitions referring to other abbreviations are not supported.
+std::size_t expand_parallel(const std::vector<ast::Entry>& entries, const Dictionary& definitions,
+    std::vector<bool>& seen, unsigned jobs, std::string& output, Counters& counters);
+
+// Contiguous, read-only view of the whole input document. Regular files are
+// memory-mapped; anything else (pipes, character devices, empty files, or "-"
+// for the standard input) is read into a single buffer.
+class Input
+{
+public:
+    // Files that may be modified in place while they are in use should not be
+    // mapped: accessing a mapping past the end of a truncated file is fatal.
+    explicit Input(const char* fileName, bool map = true)
+    {
+        if (std::string{fileName} == "-") {
+            read(std::cin);
+            return;
+        }
+
+        // Probe the file type first: opening a FIFO only to find out it cannot
+        // be mapped would discard whatever the writer has already sent.
+        std::error_code ec;
+
+        if (map && std::filesystem::is_regular_file(fileName, ec) &&
+            std::filesystem::file_size(fileName, ec) > 0 && !ec) {
+            try {
+                namespace bip = boost::interprocess;
+
+                bip::file_mapping file{fileName, bip::read_only};
+                region_ = std::make_unique<bip::mapped_region>(file, bip::read_only);
+                region_->advise(bip::mapped_region::advice_sequential);
+
+                first_ = static_cast<const char*>(region_->get_address());
+                last_ = first_ + region_->get_size();
+
+                return;
+            }
+            catch (const boost::interprocess::interprocess_exception&) {
+                region_.reset();
+            }
+        }
+
+        boost::filesystem::ifstream in{fileName, std::ios_base::binary};
+
+        if (!in)
+            throw std::runtime_error("failed to open input \"" + std::string{fileName} + '"');
+
+        read(in);
+    }
+
+    const char* begin() const noexcept
+    {
+        return first_;
+    }
+
+    const char* end() const noexcept
+    {
+        return last_;
+    }
+
+private:
+    void read(std::istream& in)
+    {
+        buffer_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+        first_ = buffer_.data();
+        last_ = first_ + buffer_.size();
+    }
+
+    std::unique_ptr<boost::interprocess::mapped_region> region_;
+    std::string buffer_;
+    const char* first_ = nullptr;
+    const char* last_ = nullptr;
+};
+
+// 64-bit FNV-1a hash
+std::uint64_t hash_bytes(std::string_view data, std::uint64_t hash = 14695981039346656037ull) noexcept;
+
+std::uint64_t hash_seen(const std::vector<bool>& seen, std::uint64_t hash = 14695981039346656037ull) noexcept;
+
+// What is known about an input from a previous run: its definitions as offsets
+// into the input, and the expanded output together with the first use state
+// after the input for the context, i.e., the dictionary and the first use
+// state before the input, it was expanded in.
+struct CacheRecord
+{
+    // Hash of the input the record belongs to
+    std::uint64_t content = 0;
+    // Offset and size of the name, short name and value of each definition
+    std::vector<std::array<std::uint64_t, 6> > definitions;
+    std::uint64_t context = 0;
+    bool expanded = false;
+    std::string_view output;
+    std::vector<bool> seen;
+    // Mapped record or the output of this run the output refers to
+    std::unique_ptr<Input> storage;
+    std::string buffer;
+};
+
+// Directory storing a record per input file, named after the hash of the
+// absolute path of the input. Records are replaced atomically so that
+// concurrent or interrupted runs never see partial records.
+class Cache
+{
+public:
+    explicit Cache(std::filesystem::path directory)
+        : directory_(std::move(directory))
+    {
+        std::filesystem::create_directories(directory_);
+    }
+
+    // Reads the record of the input. Returns false if there is none or if it
+    // cannot be used.
+    bool find(const std::string& fileName, CacheRecord& record) const
+    {
+        const std::filesystem::path path = recordPath(fileName);
+        std::error_code ec;
+
+        if (!std::filesystem::is_regular_file(path, ec))
+            return false;
+
+        try {
+            record.storage = std::make_unique<Input>(path.string().c_str());
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+
+        const char* pos = record.storage->begin();
+        const char* last = record.storage->end();
+
+        const auto read =
+            [&pos, last] (std::uint64_t& value)
+            {
+                if (static_cast<std::size_t>(last - pos) < sizeof value)
+                    return false;
+
+                std::memcpy(&value, pos, sizeof value);
+                pos += sizeof value;
+                return true;
+            };
+
+        std::uint64_t magic;
+        std::uint64_t count;
+
+        if (!read(magic) || magic != Magic || !read(record.content) || !read(count) ||
+            count > static_cast<std::size_t>(last - pos) / sizeof record.definitions.front())
+            return false;
+
+        record.definitions.resize(static_cast<std::size_t>(count));
+
+        for (auto& definition : record.definitions)
+            for (std::uint64_t& value : definition)
+                if (!read(value))
+                    return false;
+
+        std::uint64_t expanded;
+        std::uint64_t size;
+
+        if (!read(expanded) || !read(record.context) || !read(size) ||
+            static_cast<std::uint64_t>(last - pos) < size)
+            return false;
+
+        record.expanded = expanded != 0;
+        record.output = std::string_view(pos, static_cast<std::size_t>(size));
+        pos += size;
+
+        if (!read(count) || static_cast<std::uint64_t>(last - pos) < count)
+            return false;
+
+        record.seen.resize(static_cast<std::size_t>(count));
+
+        for (std::size_t i = 0; i != record.seen.size(); ++i)
+            record.seen[i] = pos[i] != 0;
+
+        return true;
+    }
+
+    // Replaces the record of the input. Failures are not fatal and only
+    // reported.
+    void store(const std::string& fileName, const CacheRecord& record) const
+    {
+        std::string data;
+
+        const auto write =
+            [&data] (std::uint64_t value)
+            {
+                data.append(reinterpret_cast<const char*>(&value), sizeof value);
+            };
+
+        write(Magic);
+        write(record.content);
+        write(record.definitions.size());
+
+        for (const auto& definition : record.definitions)
+            for (std::uint64_t value : definition)
+                write(value);
+
+        write(record.expanded);
+        write(record.context);
+        write(record.output.size());
+        data.append(record.output);
+        write(record.seen.size());
+
+        for (bool used : record.seen)
+            data.push_back(used);
+
+        const std::filesystem::path path = recordPath(fileName);
+        std::filesystem::path temporary = path;
+        // Unique among the threads of all processes sharing the directory
+        temporary += ".tmp." + std::to_string(process_id()) + "." +
+            std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+
+        std::FILE* file = std::fopen(temporary.string().c_str(), "wb");
+        bool succeeded = file != nullptr;
+
+        if (file != nullptr) {
+            succeeded = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+            succeeded &= std::fclose(file) == 0;
+        }
+
+        std::error_code ec;
+
+        if (succeeded)
+            std::filesystem::rename(temporary, path, ec);
+
+        if (!succeeded || ec) {
+            std::filesystem::remove(temporary, ec);
+            report("warning: failed to update the cache of ", std::quoted(fileName));
+        }
+    }
+
+private:
+    // Identifies the record format; to be changed along with the format
+    static constexpr std::uint64_t Magic = 0x31303058534C47ull; // "GLSX001"
+
+    // Returns the id of this process, or a random number standing in for it
+    static unsigned long long process_id()
+    {
+#ifdef HAVE_UNISTD_H
+        return static_cast<unsigned long long>(::getpid());
+#else
+        static const unsigned long long id = std::random_device{}();
+        return id;
+#endif // HAVE_UNISTD_H
+    }
+
+    std::filesystem::path recordPath(const std::string& fileName) const
+    {
+        std::error_code ec;
+        std::filesystem::path path = std::filesystem::absolute(fileName, ec);
+
+        std::ostringstream name;
+        name << std::hex << std::setw(16) << std::setfill('0') << hash_bytes(path.string()) << ".glsx";
+
+        return directory_ / name.str();
+    }
+
+    std::filesystem::path directory_;
+};
+
+// Writes the definitions of the dictionary as a compiled glossary. Returns
+// false after reporting the error if the file cannot be written.
+bool write_compiled_glossary(const std::string& fileName, const Dictionary& dictionary);
+
+// An input together with the definitions it contains, in their order. The
+// definitions refer to the input which must be kept until the expansion is
+// done. Large inputs parsed in parallel also keep their entries.
+//
+// With a cache, or if the input is kept resident, the record of the input is
+// kept too. An input that did not change since the record was stored is not
+// parsed at all.
+struct Source
+{
+    // Expanded text, before resolving \addition, and first use state of a
+    // document expanded while its definitions were collected
+    struct Expansion
+    {
+        std::string text;
+        std::vector<bool> seen;
+        Counters counters;
+        // The preceding definitions followed by those of the document, in
+        // the order the dictionary of all inputs is built in; taken over by
+        // that to avoid building and rendering it once more
+        std::optional<Dictionary> definitions;
+    };
+
+    std::unique_ptr<Input> input;
+    std::vector<ast::Abbreviation> definitions;
+    std::optional<std::vector<ast::Entry> > entries;
+    std::optional<CacheRecord> record;
+    std::optional<Expansion> expansion;
+    // Tables of a compiled glossary that apply to this build
+    std::optional<Dictionary::Tables> tables;
+    // Problems reported while loading, only ever nonzero if recovering
+    std::size_t errors = 0;
+};
+
+// Opens the input of the source. Returns false after reporting the error if
+// the input cannot be opened.
+bool open(const std::string& fileName, bool resident, Source& source);
+
+// Opens the input unless it is open already and collects its definitions
+// using up to jobs threads. A
+// resident input is read into memory instead of being mapped and keeps its
+// record even without a cache. Returns false after reporting the error if the
+// input cannot be used. If recovering, the parse continues after errors,
+// which are reported and counted in the source. Only a glossary may be a
+// compiled glossary.
+bool load(const std::string& fileName, unsigned jobs, const Cache* cache, bool resident, bool recover,
+    bool glossary, Source& source);
+
+// Collects the definitions of an opened document that is expanded last and
+// expands it in the same pass, starting from the preceding definitions. This
+// succeeds if the document defines each abbreviation before its first use,
+// which is the common case, and saves parsing it a second time. Otherwise,
+// the source is left as it was and the document must be loaded as usual.
+bool load_expanded(Source& source, Dictionary definitions);
+
+// Expands the document into the sink using up to jobs threads. The first use
+// state is read and updated in seen. Returns false after reporting the error
+// if the expansion failed. If recovering, the whole document is expanded
+// regardless and all errors are reported; the document still counts as
+// failed then, also if it was loaded with errors.
+template<class Sink>
+bool expand_document(const std::string& fileName, const Source& source, const Dictionary& definitions,
+    std::vector<bool>& seen, unsigned jobs, bool recover, Sink& out)
+{
+    GLSEXPAND_TRACE_SCOPE(expand);
+
+    // \addition is resolved in the expanded text, including the expansions
+    // themselves, as it is written out
+    CountingSink<Sink> counted{out};
+    AdditionFilter filter{counted};
+
+    // Parse errors have been reported while loading already
+    Diagnostics parsing{source.input->begin(), source.input->end(), recover};
+    Diagnostics diagnostics{source.input->begin(), source.input->end(), recover};
+
+    Expand e{filter, definitions, seen};
+    e.diagnostics = &diagnostics;
+    // The sink may keep views of the parallel expansion until it is flushed,
+    // so flush it on every path before this goes out of scope
+    std::string expanded;
+
+    try {
+        // The first use is resolved in document order in either case
+        if (source.expansion) {
+            filter.write(source.expansion->text);
+            seen = source.expansion->seen;
+            seen.resize(definitions.size());
+            e.counters = source.expansion->counters;
+        }
+        else if (source.entries && jobs > 1 && !definitions.nested()) {
+            const std::vector<ast::Entry>& entries = *source.entries;
+            const std::size_t undefined = expand_parallel(entries, definitions, seen, jobs, expanded, e.counters);
+
+            if (undefined == entries.size())
+                filter.write(expanded);
+            else if (!recover) {
+                // Locate the reference as the sequential expansion does
+                const auto& value = boost::get<ast::Reference>(entries[undefined].get());
+                e.fail(value, "missing definition for " + std::string{value.name});
+            }
+            else {
+                // The parallel expansion stops at the first error: start over
+                // sequentially to find all of them
+                for (const ast::Entry& entry : entries)
+                    entry.apply_visitor(e);
+            }
+        }
+        else if (source.entries) {
+            for (const ast::Entry& entry : *source.entries)
+                entry.apply_visitor(e);
+        }
+        else
+            for_each_entry(source.input->begin(), source.input->end(), &definitions, e, &parsing);
+    }
+    catch (const std::runtime_error& error) {
+        ++e.counters.missing;
+        statistics.add(e.counters);
+
+        if (diagnostics.empty())
+            report("error: ", error.what(), " in ", std::quoted(fileName));
+        else
+            diagnostics.report(fileName);
+
+        out.flush();
+        return false;
+    }
+
+    const bool finished = filter.finish();
+
+    e.counters.outputBytes = counted.bytes;
+    statistics.add(e.counters);
+
+    if (!finished) {
+        report("error: failed to parse the input ", std::quoted(fileName));
+        out.flush();
+        return false;
+    }
+
+    if (!out.flush()) {
+        report("error: failed to write the output of ", std::quoted(fileName));
+        return false;
+    }
+
+    if (!diagnostics.empty())
+        diagnostics.report(fileName);
+
+    return diagnostics.empty() && source.errors == 0;
+}
+
+// What the expansion of all inputs shares
+struct Environment
+{
+    const Dictionary& definitions;
+    // Hash of all definitions; the cached output depends on it
+    std::uint64_t fingerprint = 0;
+    const Cache* cache = nullptr;
+    // Whether to expand inputs with errors as far as possible
+    bool recover = false;
+};
+
+// Same as above, but reuses the cached output if neither the input nor the
+// context it is expanded in have changed. Otherwise the record is updated
+// with the new output and stored in the cache, if any.
+template<class Sink>
+bool expand(const std::string& fileName, Source& source, const Environment& environment,
+    std::vector<bool>& seen, unsigned jobs, Sink& out)
+{
+    if (!source.record)
+        return expand_document(fileName, source, environment.definitions, seen, jobs, environment.recover, out);
+
+    CacheRecord& record = *source.record;
+    const std::uint64_t context = hash_seen(seen, environment.fingerprint);
+
+    if (record.expanded && record.context == context) {
+        out.write(record.output);
+        seen = record.seen;
+
+        Counters counters;
+        counters.cached = 1;
+        counters.outputBytes = record.output.size();
+        statistics.add(counters);
+
+        if (!out.flush()) {
+            report("error: failed to write the output of ", std::quoted(fileName));
+            return false;
+        }
+
+        return true;
+    }
+
+    TeeSink<Sink> tee{out};
+
+    if (!expand_document(fileName, source, environment.definitions, seen, jobs, environment.recover, tee))
+        return false;
+
+    record.buffer = std::move(tee.copy);
+    record.output = record.buffer;
+    record.expanded = true;
+    record.context = context;
+    record.seen = seen;
+
+    if (environment.cache != nullptr)
+        environment.cache->store(fileName, record);
+
+    return true;
+}
+
+// Same as above, but writes the expanded document to the file
+bool expand_file(const std::string& fileName, Source& source, const Environment& environment,
+    std::vector<bool>& seen, unsigned jobs, std::FILE* file);
+
+// Expands the input while it is still being read and writes out the result
+// of each block right away, so that the output starts before the input ends.
+// This requires the input to define each abbreviation before its first use.
+// A reader thread passes the input through a bounded queue; the expansion
+// parses each block as far as its entries are complete and keeps the rest
+// for the next one. Returns false after reporting the error if the input
+// cannot be expanded.
+bool expand_stream(const std::string& fileName, Dictionary definitions, std::FILE* output);
+
+// Wall time and bytes processed by a stage of a run
+struct Stage
+{
+    const char* name;
+    double seconds = 0;
+    std::uint64_t bytes = 0;
+};
+
+// Writes the statistics of a run as a JSON object. The load stage covers
+// reading and parsing the inputs for their definitions, the dictionary stage
+// rendering the expansions, and the expand stage parsing the documents again,
+// expanding them, resolving \addition and writing the output; the latter are
+// interleaved while streaming and cannot be timed apart. The peak memory is
+// that of the whole process so far.
+void write_statistics(std::ostream& out, const std::vector<Stage>& stages,
+    std::size_t inputs, std::size_t definitions, const Dictionary& dictionary, std::size_t allocations);
+
+// Waits for any of a set of files to change. Editors often replace a file by
+// renaming a new one over it, so the directories containing the files are
+// watched rather than the files themselves. Without inotify, the modification
+// times are polled.
+class Watcher
+{
+public:
+    explicit Watcher(const std::vector<std::string>& fileNames)
+    {
+        for (std::size_t i = 0; i != fileNames.size(); ++i) {
+            std::error_code ec;
+            std::filesystem::path path = std::filesystem::absolute(fileNames[i], ec).lexically_normal();
+
+            files_[path.string()].push_back(i);
+        }
+
+#ifdef HAVE_INOTIFY
+        fd_ = ::inotify_init1(IN_CLOEXEC);
+
+        if (fd_ == -1)
+            throw std::runtime_error("failed to initialize inotify");
+
+        std::set<std::filesystem::path> directories;
+
+        for (const auto& file : files_)
+            directories.insert(std::filesystem::path{file.first}.parent_path());
+
+        for (const std::filesystem::path& directory : directories) {
+            const int wd = ::inotify_add_watch(fd_, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+
+            if (wd == -1)
+                throw std::runtime_error("failed to watch " + directory.string());
+
+            directories_[wd] = directory;
+        }
+#else
+        for (const auto& file : files_)
+            stamps_[file.first] = stamp(file.first);
+#endif // HAVE_INOTIFY
+    }
+
+    Watcher(const Watcher&) = delete;
+    Watcher& operator=(const Watcher&) = delete;
+
+    ~Watcher()
+    {
+#ifdef HAVE_INOTIFY
+        if (fd_ != -1)
+            ::close(fd_);
+#endif // HAVE_INOTIFY
+    }
+
+    // Blocks until at least one of the files changed. Changes following each
+    // other closely, such as saving several files at once, are combined.
+    // Returns the sorted indices of the changed files.
+    std::vector<std::size_t> wait()
+    {
+        std::set<std::size_t> changed;
+
+        while (changed.empty()) {
+#ifdef HAVE_INOTIFY
+            // Block for the first event, then collect the ones that follow
+            for (int timeout = -1; ; timeout = Settle) {
+                pollfd fds{fd_, POLLIN, 0};
+
+                if (::poll(&fds, 1, timeout) <= 0)
+                    break;
+
+                alignas(inotify_event) char buffer[4096];
+                const ssize_t n = ::read(fd_, buffer, sizeof buffer);
+
+                for (ssize_t pos = 0; pos < n; ) {
+                    const auto* event = reinterpret_cast<const inotify_event*>(buffer + pos);
+                    pos += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+
+                    if (event->len == 0)
+                        continue;
+
+                    auto directory = directories_.find(event->wd);
+
+                    if (directory == directories_.end())
+                        continue;
+
+                    auto file = files_.find((directory->second / event->name).string());
+
+                    if (file != files_.end())
+                        changed.insert(file->second.begin(), file->second.end());
+                }
+            }
+#else
+            std::this_thread::sleep_for(std::chrono::milliseconds(Settle));
+
+            for (auto& [fileName, previous] : stamps_) {
+                auto current = stamp(fileName);
+
+                if (current != previous) {
+                    previous = current;
+                    changed.insert(files_[fileName].begin(), files_[fileName].end());
+                }
+            }
+#endif // HAVE_INOTIFY
+        }
+
+        return {changed.begin(), changed.end()};
+    }
+
+private:
+    // Milliseconds to wait for further changes
+    static constexpr int Settle = 100;
+
+    // Indices of the files by their absolute path
+    std::map<std::string, std::vector<std::size_t> > files_;
+#ifdef HAVE_INOTIFY
+    int fd_ = -1;
+    std::map<int, std::filesystem::path> directories_;
+#else
+    using Stamp = std::pair<std::filesystem::file_time_type, std::uintmax_t>;
+
+    static Stamp stamp(const std::string& fileName)
+    {
+        std::error_code ec;
+        return {std::filesystem::last_write_time(fileName, ec), std::filesystem::file_size(fileName, ec)};
+    }
+
+    std::map<std::string, Stamp> stamps_;
+#endif // HAVE_INOTIFY
+};
+
+#endif // GLSEXPAND_CORE_HPP
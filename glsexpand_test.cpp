@@ -0,0 +1,215 @@
+//
+// Copyright (c) 2019 Sergiu Deitsch <sergiu.deitsch@gmail.com>
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//  * Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+//  * Redistributions in binary form must reproduce the above copyright notice,
+// this list of conditions and the following disclaimer in the documentation and/or
+// other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+// ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+// (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+// LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+// ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+// Regression tests of the internals that the comparison of the expanded
+// sample documents in tests/ does not reach reliably
+#include "glsexpand_core.hpp"
+
+#include <cstdio>
+#include <fstream>
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, const char* what)
+{
+    if (!condition) {
+        std::fprintf(stderr, "FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+#ifdef HAVE_WRITEV
+// Short pieces copied into the staging buffer must survive the flush that
+// makes room for more segments. Alternating views with copies adds a segment
+// for each piece until the limit is reached with a copy pending.
+void gather_writer_segment_limit()
+{
+    std::FILE* file = std::tmpfile();
+    check(file != nullptr, "tmpfile");
+
+    if (file == nullptr)
+        return;
+
+    // Views must not be adjacent, otherwise the segments would be merged
+    constexpr std::size_t ViewSize = 90;
+    constexpr std::size_t Pieces = 20000;
+    std::string views;
+    std::string expected;
+
+    for (std::size_t i = 0; i != Pieces; ++i) {
+        views.append(ViewSize, static_cast<char>('a' + i % 26));
+        views.push_back('|');
+    }
+
+    {
+        GatherWriter writer(::fileno(file));
+
+        writer.put('^');
+        expected.push_back('^');
+
+        for (std::size_t i = 0; i != Pieces; ++i) {
+            const std::string_view view(views.data() + i * (ViewSize + 1), ViewSize);
+            const char copy[] = {static_cast<char>('0' + i % 10), static_cast<char>('0' + i / 10 % 10)};
+
+            writer.write(view);
+            writer.write(std::string_view(copy, sizeof copy));
+
+            expected.append(view);
+            expected.append(copy, sizeof copy);
+        }
+
+        check(writer.flush(), "GatherWriter::flush");
+    }
+
+    std::string actual(expected.size() + 1, '\0');
+    std::rewind(file);
+    actual.resize(std::fread(&actual[0], 1, actual.size(), file));
+    std::fclose(file);
+
+    check(actual.size() == expected.size(), "GatherWriter output size");
+
+    const auto mismatch = std::mismatch(actual.begin(), actual.end(), expected.begin(), expected.end());
+
+    if (mismatch.first != actual.end() || mismatch.second != expected.end())
+        std::fprintf(stderr, "GatherWriter output differs at offset %zu\n",
+            static_cast<std::size_t>(mismatch.first - actual.begin()));
+
+    check(actual == expected, "GatherWriter output");
+}
+#endif // HAVE_WRITEV
+
+// Output sink that, like GatherWriter, keeps the written views until it is
+// flushed
+struct ViewSink
+{
+    void write(std::string_view value)
+    {
+        pending.push_back(value);
+    }
+
+    void put(char c)
+    {
+        text.push_back(c);
+    }
+
+    bool flush()
+    {
+        for (std::string_view value : pending)
+            text.append(value);
+
+        pending.clear();
+        return true;
+    }
+
+    std::vector<std::string_view> pending;
+    std::string text;
+};
+
+// A document expanded in parallel is rendered into a buffer of its own whose
+// views must be written out before the expansion returns, also if the
+// expanded text turns out to be malformed
+void expand_document_flushes_on_failure()
+{
+    // In the working directory of the test, which is the build directory
+    const std::filesystem::path path{"expand_document_flushes_on_failure.tex"};
+
+    {
+        std::ofstream out{path, std::ios_base::binary};
+        out << "\\newacronym{gpu}{GPU}{graphics unit}\n";
+
+        for (std::size_t n = 0; n < 3 * MinChunkSize; n += 32)
+            out << "Text with a \\gls{gpu} reference.\n";
+
+        out << "\\addition{x}\n";
+    }
+
+    Source source;
+    const bool loaded = load(path.string(), 4, nullptr, false, false, false, source);
+    check(loaded && source.entries, "load in parallel");
+
+    if (loaded && source.entries) {
+        BuildDictionary dict;
+
+        for (const ast::Abbreviation& definition : source.definitions)
+            dict(definition);
+
+        dict.dict.finalize();
+
+        ViewSink sink;
+        std::vector<bool> seen;
+
+        check(!expand_document(path.string(), source, dict.dict, seen, 4, false, sink),
+            "expand_document fails on a malformed \\addition");
+        check(sink.pending.empty(), "expand_document flushes the views on failure");
+    }
+
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+}
+
+// A nested expansion that fails must neither write part of the expansion nor
+// mark the definitions expanded up to the error as used
+void write_expansion_fails_atomically()
+{
+    Dictionary definitions;
+    definitions.insert(ast::Abbreviation{"gpu", "GPU", "graphics unit"});
+    definitions.insert(ast::Abbreviation{"x", "X", "see \\gls{gpu} and \\gls{missing}"});
+    definitions.insert(ast::Abbreviation{"c", "C", "see \\gls{d}"});
+    definitions.insert(ast::Abbreviation{"d", "D", "see \\gls{c}"});
+    definitions.finalize();
+
+    for (std::string_view name : {"x", "c"}) {
+        StringSink sink;
+        std::vector<bool> seen(definitions.size());
+        bool failed = false;
+
+        try {
+            write_expansion(sink, definitions, definitions.find(name), 0, seen);
+        }
+        catch (const std::runtime_error&) {
+            failed = true;
+        }
+
+        check(failed, "write_expansion fails on a nested error");
+        check(sink.text.empty(), "write_expansion writes nothing on a nested error");
+        check(std::find(seen.begin(), seen.end(), true) == seen.end(),
+            "write_expansion marks nothing as used on a nested error");
+    }
+}
+
+} // namespace
+
+int main()
+{
+#ifdef HAVE_WRITEV
+    gather_writer_segment_limit();
+#endif // HAVE_WRITEV
+    expand_document_flushes_on_failure();
+    write_expansion_fails_atomically();
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}